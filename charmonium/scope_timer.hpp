@@ -14,7 +14,38 @@ namespace charmonium::scope_timer {
 	using ScopeTimerArgs = detail::ScopeTimerArgs;
 	using CpuNs = detail::CpuTime;
 	using WallNs = detail::WallTime;
+	using WallClock = detail::WallClock;
+	using WallClockSource = detail::WallClockSource;
+	using CpuClock = detail::CpuClock;
+	using HardwareCounter = detail::HardwareCounter;
+	using HardwareCounters = detail::HardwareCounters;
+	using SchedCounts = detail::SchedCounts;
+	using SchedEvents = detail::SchedEvents;
+	using Overhead = detail::Overhead;
+	using CallSite = detail::CallSite;
+	using CallSiteId = detail::CallSiteId;
+	using CallSiteCache = detail::CallSiteCache;
+	using CallSiteTable = detail::CallSiteTable;
 	using CallbackType = detail::CallbackType;
+	using CollectorCallbackType = detail::CollectorCallbackType;
+	using ThreadBatch = detail::ThreadBatch;
+	using ThreadSample = detail::ThreadSample;
+	using LiveFrame = detail::LiveFrame;
+	using LiveStack = detail::LiveStack;
+	using SampleTree = detail::SampleTree;
+	using SampleNode = detail::SampleNode;
+	using CallSiteRate = detail::CallSiteRate;
+	using Histogram = detail::Histogram;
+	using CallSiteLatency = detail::CallSiteLatency;
+	using Latencies = detail::Latencies;
+	using SketchKey = detail::SketchKey;
+	using QuantileSketch = detail::QuantileSketch;
+	using KeyedLatency = detail::KeyedLatency;
+	using SketchTable = detail::SketchTable;
+	using CallTree = detail::CallTree;
+	using CallTreeNode = detail::CallTreeNode;
+	using OverflowPolicy = detail::OverflowPolicy;
+	using FlushTriggers = detail::FlushTriggers;
 	using Process = detail::Process;
 	using Thread = detail::Thread;
 	using TypeEraser = detail::TypeEraser;
@@ -33,25 +64,27 @@ namespace charmonium::scope_timer {
 	// In C++14, we could use templated function aliases
 	template <typename T>
 	TypeEraser make_type_eraser(T* ptr) {
-		return std::static_pointer_cast<void>(std::shared_ptr<T>{ptr});
+		return TypeEraser::adopt<T>(ptr);
 	}
 	template <typename T, class... Args>
 	TypeEraser make_type_eraser(Args&&... args) {
-		return std::static_pointer_cast<void>(std::make_shared<T>(std::forward<Args>(args)...));
+		return TypeEraser::make<T>(std::forward<Args>(args)...);
 	}
 	template <typename T>
 	const T& extract_type_eraser(const TypeEraser& type_eraser) {
-		return *std::static_pointer_cast<T>(type_eraser);
+		return type_eraser.get<T>();
 	}
 	template <typename T>
 	T& extract_type_eraser(TypeEraser& type_eraser) {
-		return *std::static_pointer_cast<T>(type_eraser);
+		return type_eraser.get<T>();
 	}
 
 } // namespace charmonium::scope_timer
 
 
 #define SCOPE_TIMER(args_dot_set_vars)                                            \
+    static charmonium::scope_timer::CallSiteCache                                 \
+        CHARMONIUM_SCOPE_TIMER_UNIQUE_CALLSITE_NAME() {};                         \
     charmonium::scope_timer::ScopeTimer CHARMONIUM_SCOPE_TIMER_UNIQUE_NAME() {(   \
         charmonium::scope_timer::ScopeTimerArgs{                                  \
             charmonium::scope_timer::type_eraser_default,                         \
@@ -59,6 +92,7 @@ namespace charmonium::scope_timer {
             false,                                                                \
             &charmonium::scope_timer::get_process(),                              \
             &charmonium::scope_timer::get_thread(),                               \
-            CHARMONIUM_SCOPE_TIMER_SOURCE_LOC()                                   \
+            CHARMONIUM_SCOPE_TIMER_SOURCE_LOC(),                                  \
+            &CHARMONIUM_SCOPE_TIMER_UNIQUE_CALLSITE_NAME()                        \
         } args_dot_set_vars                                                       \
     )};
@@ -0,0 +1,259 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief The frames of one calling context (path of CallSites from the thread's root frame), aggregated.
+	 *
+	 * Inclusive times count the frame and its callees; exclusive times count only the frame itself.
+	 */
+	class CallTreeNode {
+	private:
+		friend class CallTree;
+
+		CallSiteId callsite;
+		uint32_t parent;
+		// Only used to find children.
+		uint32_t first_child;
+		uint32_t next_sibling;
+
+		uint64_t count {0};
+		CpuTime cpu {0};
+		CpuTime cpu_exclusive {0};
+		CpuTime cpu_min {0};
+		CpuTime cpu_max {0};
+		WallStamp wall {0};
+		WallStamp wall_exclusive {0};
+		WallStamp wall_min {0};
+		WallStamp wall_max {0};
+		WallStamp max_gap_wall {0};
+		CallSiteId max_gap_next_callsite {0};
+		WallStamp max_gap_wall_sum {0};
+		CpuTime max_gap_cpu {0};
+		CallSiteId max_gap_cpu_next_callsite {0};
+		CpuTime max_gap_cpu_sum {0};
+
+		CallTreeNode(CallSiteId callsite_, uint32_t parent_, uint32_t next_sibling_)
+			: callsite{callsite_}
+			, parent{parent_}
+			, first_child{0}
+			, next_sibling{next_sibling_}
+		{ }
+
+		void add(const CallTreeNode& other) {
+			if (other.count == 0) {
+				return;
+			}
+			cpu_min = count == 0 ? other.cpu_min : std::min(cpu_min, other.cpu_min);
+			cpu_max = count == 0 ? other.cpu_max : std::max(cpu_max, other.cpu_max);
+			wall_min = count == 0 ? other.wall_min : std::min(wall_min, other.wall_min);
+			wall_max = count == 0 ? other.wall_max : std::max(wall_max, other.wall_max);
+			if (other.max_gap_wall > max_gap_wall) {
+				max_gap_wall = other.max_gap_wall;
+				max_gap_next_callsite = other.max_gap_next_callsite;
+			}
+			if (other.max_gap_cpu > max_gap_cpu) {
+				max_gap_cpu = other.max_gap_cpu;
+				max_gap_cpu_next_callsite = other.max_gap_cpu_next_callsite;
+			}
+			max_gap_wall_sum += other.max_gap_wall_sum;
+			max_gap_cpu_sum += other.max_gap_cpu_sum;
+			count += other.count;
+			cpu += other.cpu;
+			cpu_exclusive += other.cpu_exclusive;
+			wall += other.wall;
+			wall_exclusive += other.wall_exclusive;
+		}
+
+		void clear() {
+			count = 0;
+			cpu = cpu_exclusive = cpu_min = cpu_max = max_gap_cpu = max_gap_cpu_sum = CpuTime{0};
+			wall = wall_exclusive = wall_min = wall_max = max_gap_wall = max_gap_wall_sum = 0;
+			max_gap_next_callsite = max_gap_cpu_next_callsite = 0;
+		}
+
+		static WallTime to_time(WallStamp stamps) { return get_shared_wall_clock().to_duration(stamps); }
+
+	public:
+		CallSiteId get_callsite_id() const { return callsite; }
+		const char* get_name() const { return get_shared_callsites().get(callsite).name; }
+		const SourceLoc& get_source_loc() const { return get_shared_callsites().get(callsite).source_loc; }
+
+		/**
+		 * @brief The index of the caller's node; the root (index 0) is its own parent.
+		 */
+		uint32_t get_parent() const { return parent; }
+
+		/**
+		 * @brief The number of frames which finished in this calling context.
+		 */
+		uint64_t get_count() const { return count; }
+
+		CpuTime get_cpu() const { return cpu; }
+		CpuTime get_cpu_exclusive() const { return cpu_exclusive; }
+		CpuTime get_cpu_min() const { return cpu_min; }
+		CpuTime get_cpu_max() const { return cpu_max; }
+		WallTime get_wall() const { return to_time(wall); }
+		WallTime get_wall_exclusive() const { return to_time(wall_exclusive); }
+		WallTime get_wall_min() const { return to_time(wall_min); }
+		WallTime get_wall_max() const { return to_time(wall_max); }
+
+		/**
+		 * @brief The longest uninstrumented gap in any of these frames (see Timer::get_max_gap_wall).
+		 */
+		WallTime get_max_gap_wall() const { return to_time(max_gap_wall); }
+
+		/**
+		 * @brief The CallSite of the child which ends that gap, or 0 if the frame's stop ends it.
+		 */
+		CallSiteId get_max_gap_next_callsite() const { return max_gap_next_callsite; }
+
+		/**
+		 * @brief The sum over these frames of each one's longest uninstrumented gap.
+		 *
+		 * Compare it with get_wall_exclusive: the time one more SCOPE_TIMER in each frame could explain.
+		 */
+		WallTime get_max_gap_wall_sum() const { return to_time(max_gap_wall_sum); }
+
+		/**
+		 * @brief Like get_max_gap_wall, but in CPU time (see Timer::get_max_gap_cpu).
+		 */
+		CpuTime get_max_gap_cpu() const { return max_gap_cpu; }
+
+		/**
+		 * @brief Like get_max_gap_next_callsite, but for get_max_gap_cpu.
+		 */
+		CallSiteId get_max_gap_cpu_next_callsite() const { return max_gap_cpu_next_callsite; }
+
+		/**
+		 * @brief Like get_max_gap_wall_sum, but in CPU time.
+		 */
+		CpuTime get_max_gap_cpu_sum() const { return max_gap_cpu_sum; }
+	};
+
+	/**
+	 * @brief A calling-context tree: frames aggregated by the path of CallSites which led to them.
+	 *
+	 * Its size is proportional to the number of distinct paths, not the number of frames.
+	 * Nodes are never removed, and callers precede their callees.
+	 */
+	class CallTree {
+	private:
+		std::vector<CallTreeNode> nodes;
+
+	public:
+		/**
+		 * @brief A tree with only the root node, which stands for each thread's root frame.
+		 */
+		CallTree()
+			: nodes{CallTreeNode{0, 0, 0}}
+		{ }
+
+		/**
+		 * @brief The node for @p callsite called from @p parent, or 0 (the root, which is nobody's child) if absent.
+		 */
+		uint32_t find_child(uint32_t parent, CallSiteId callsite) const {
+			for (uint32_t child = nodes[parent].first_child; child != 0; child = nodes[child].next_sibling) {
+				if (nodes[child].callsite == callsite) {
+					return child;
+				}
+			}
+			return 0;
+		}
+
+		/**
+		 * @brief The node for @p callsite called from @p parent, added if absent.
+		 */
+		uint32_t get_child(uint32_t parent, CallSiteId callsite) {
+			uint32_t found = find_child(parent, callsite);
+			if (found != 0) {
+				return found;
+			}
+			auto child = static_cast<uint32_t>(nodes.size());
+			nodes.push_back(CallTreeNode{callsite, parent, nodes[parent].first_child});
+			nodes[parent].first_child = child;
+			return child;
+		}
+
+		/**
+		 * @brief Accounts for one finished frame in @p node.
+		 */
+		void add(uint32_t node, const Timer& timer) {
+			CpuTime cpu = timer.get_cpu_duration();
+			WallStamp wall = timer.get_wall_stamps();
+			CallTreeNode& frame = nodes[node];
+			WallStamp gap_wall = timer.WallGaps::get_max_gap_stamps();
+			CpuTime gap_cpu = timer.get_max_gap_cpu();
+			if (gap_wall > frame.max_gap_wall) {
+				frame.max_gap_wall = gap_wall;
+				frame.max_gap_next_callsite = timer.get_max_gap_next_callsite();
+			}
+			if (gap_cpu > frame.max_gap_cpu) {
+				frame.max_gap_cpu = gap_cpu;
+				frame.max_gap_cpu_next_callsite = timer.get_max_gap_cpu_next_callsite();
+			}
+			frame.max_gap_wall_sum += gap_wall;
+			frame.max_gap_cpu_sum += gap_cpu;
+			frame.cpu_min = frame.count == 0 ? cpu : std::min(frame.cpu_min, cpu);
+			frame.cpu_max = frame.count == 0 ? cpu : std::max(frame.cpu_max, cpu);
+			frame.wall_min = frame.count == 0 ? wall : std::min(frame.wall_min, wall);
+			frame.wall_max = frame.count == 0 ? wall : std::max(frame.wall_max, wall);
+			++frame.count;
+			frame.cpu += cpu;
+			frame.cpu_exclusive += timer.get_exclusive_cpu();
+			frame.wall += wall;
+			frame.wall_exclusive += timer.get_exclusive_wall_stamps();
+		}
+
+		/**
+		 * @brief Adds every node of @p other to the node with the same path in this.
+		 */
+		void merge(const CallTree& other) {
+			// Callers precede callees, so each parent is already mapped.
+			std::vector<uint32_t> mapped (other.nodes.size(), 0);
+			nodes[0].add(other.nodes[0]);
+			for (uint32_t i = 1; i < other.nodes.size(); ++i) {
+				mapped[i] = get_child(mapped[other.nodes[i].parent], other.nodes[i].callsite);
+				nodes[mapped[i]].add(other.nodes[i]);
+			}
+		}
+
+		/**
+		 * @brief Zeroes every node, keeping the paths (so node indices stay valid).
+		 *
+		 * This writes only the counts, so it does not race with find_child.
+		 */
+		void reset() {
+			for (CallTreeNode& node : nodes) {
+				node.clear();
+			}
+		}
+
+		/**
+		 * @brief The nodes merged by CallSite, whatever their path, indexed by CallSiteId.
+		 *
+		 * Index 0 holds the threads' root frames. CallSites absent from the tree have a count of 0, and every parent is 0.
+		 * Exclusive times and gaps sum correctly; inclusive times count a recursive CallSite's nested frames more than once.
+		 */
+		std::vector<CallTreeNode> get_callsite_totals() const {
+			std::vector<CallTreeNode> totals;
+			for (const CallTreeNode& node : nodes) {
+				while (totals.size() <= node.callsite) {
+					totals.push_back(CallTreeNode{static_cast<CallSiteId>(totals.size()), 0, 0});
+				}
+				totals[node.callsite].add(node);
+			}
+			return totals;
+		}
+
+		const std::vector<CallTreeNode>& get_nodes() const { return nodes; }
+		const CallTreeNode& operator[](uint32_t i) const { return nodes[i]; }
+		size_t size() const { return nodes.size(); }
+	};
+
+} // namespace charmonium::scope_timer::detail
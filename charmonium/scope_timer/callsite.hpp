@@ -0,0 +1,250 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "source_loc.hpp"
+#include "util.hpp"
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace charmonium::scope_timer::detail {
+
+	using CallSiteId = uint32_t;
+
+	class CallSiteTable;
+
+	/**
+	 * @brief A name and SourceLoc which many Timers share.
+	 *
+	 * Timers hold a CallSiteId instead of these, to save space.
+	 */
+	struct CallSite {
+		const CallSiteTable* table {nullptr};
+		CallSiteId id {0};
+		const char* name {""};
+		SourceLoc source_loc;
+		// See CallSiteTable::set_enabled.
+		std::atomic<bool> enabled {true};
+
+		/**
+		 * @brief Whether SCOPE_TIMERs at this CallSite record frames.
+		 */
+		bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+		bool matches(const char* name_, const SourceLoc& source_loc_) const {
+			return name == name_
+				&& source_loc.get_line() == source_loc_.get_line()
+				&& source_loc.get_function_name() == source_loc_.get_function_name()
+				&& source_loc.get_file_name() == source_loc_.get_file_name();
+		}
+	};
+
+	/**
+	 * @brief Every CallSite in the process, registered once, read without locks.
+	 *
+	 * CallSites are keyed by the identity (not the contents) of their strings,
+	 * so names should outlive the process's Timers, like string literals do.
+	 * Entries live in fixed-size chunks which are never moved, so readers need only an acquire-load.
+	 * Id 0 is the anonymous CallSite of each thread's root frame.
+	 * When the table is full, new CallSites fall back to id 0.
+	 */
+	class CallSiteTable {
+	private:
+		static constexpr size_t chunk_bits = 10;
+		static constexpr size_t chunk_size = size_t{1} << chunk_bits;
+		static constexpr size_t max_chunks = 4096;
+
+		struct Key {
+			const char* name;
+			const char* function_name;
+			const char* file_name;
+			size_t line;
+			bool operator==(const Key& other) const {
+				return name == other.name && function_name == other.function_name && file_name == other.file_name && line == other.line;
+			}
+		};
+		struct KeyHash {
+			size_t operator()(const Key& key) const {
+				std::hash<const void*> hash;
+				size_t seed = hash(key.name);
+				seed ^= hash(key.function_name) + 0x9e3779b9 + (seed << 6U) + (seed >> 2U);
+				seed ^= hash(key.file_name) + 0x9e3779b9 + (seed << 6U) + (seed >> 2U);
+				seed ^= key.line + 0x9e3779b9 + (seed << 6U) + (seed >> 2U);
+				return seed;
+			}
+		};
+
+		std::array<std::atomic<CallSite*>, max_chunks> chunks;
+		std::atomic<CallSiteId> size;
+		std::mutex mutex;
+		std::unordered_map<Key, CallSiteId, KeyHash> ids; // locked by mutex
+		// Applied in order to each new CallSite.
+		std::vector<std::pair<std::function<bool(const CallSite&)>, bool>> enabled_rules; // locked by mutex
+
+	public:
+		CallSiteTable()
+			: size{0}
+		{
+			for (auto& chunk : chunks) {
+				chunk.store(nullptr, std::memory_order_relaxed);
+			}
+			intern("", SourceLoc{});
+		}
+
+		~CallSiteTable() {
+			for (auto& chunk : chunks) {
+				delete[] chunk.load(std::memory_order_relaxed);
+			}
+		}
+
+		CallSiteTable(const CallSiteTable&) = delete;
+		CallSiteTable& operator=(const CallSiteTable&) = delete;
+		CallSiteTable(CallSiteTable&&) = delete;
+		CallSiteTable& operator=(CallSiteTable&&) = delete;
+
+		/**
+		 * @brief Find or register a CallSite.
+		 *
+		 * This takes a lock, so callers cache the result (see CallSiteCache).
+		 */
+		const CallSite& intern(const char* name, const SourceLoc& source_loc) {
+			std::lock_guard<std::mutex> lock {mutex};
+			Key key {name, source_loc.get_function_name(), source_loc.get_file_name(), source_loc.get_line()};
+			auto it = ids.find(key);
+			if (it != ids.end()) {
+				return get(it->second);
+			}
+			CallSiteId id = size.load(std::memory_order_relaxed);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(id >= chunk_size * max_chunks)) {
+				return get(0);
+			}
+			std::atomic<CallSite*>& chunk = chunks.at(id >> chunk_bits);
+			if (chunk.load(std::memory_order_relaxed) == nullptr) {
+				chunk.store(new CallSite[chunk_size], std::memory_order_release);
+			}
+			CallSite& callsite = chunk.load(std::memory_order_relaxed)[id & (chunk_size - 1)];
+			callsite.table = this;
+			callsite.id = id;
+			callsite.name = name;
+			callsite.source_loc = source_loc;
+			for (const auto& rule : enabled_rules) {
+				if (rule.first(callsite)) {
+					callsite.enabled.store(rule.second, std::memory_order_relaxed);
+				}
+			}
+			ids.emplace(key, id);
+			size.store(id + 1, std::memory_order_release);
+			return callsite;
+		}
+
+		/**
+		 * @brief The CallSite registered as @p id.
+		 */
+		const CallSite& get(CallSiteId id) const {
+			assert(id < size.load(std::memory_order_relaxed));
+			return chunks[id >> chunk_bits].load(std::memory_order_acquire)[id & (chunk_size - 1)];
+		}
+
+		/**
+		 * @brief The number of CallSites registered so far.
+		 */
+		CallSiteId get_size() const { return size.load(std::memory_order_acquire); }
+
+		/**
+		 * @brief Enables or disables the CallSite @p id; this takes effect immediately for all threads.
+		 */
+		void set_enabled(CallSiteId id, bool enabled) {
+			const_cast<CallSite&>(get(id)).enabled.store(enabled, std::memory_order_relaxed); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+		}
+
+		/**
+		 * @brief Enables or disables every CallSite, present and future, which matches @p predicate.
+		 *
+		 * Later calls take precedence over earlier ones. This takes effect immediately for all threads.
+		 */
+		void set_enabled(std::function<bool(const CallSite&)> predicate, bool enabled) {
+			std::lock_guard<std::mutex> lock {mutex};
+			CallSiteId size_ = size.load(std::memory_order_relaxed);
+			for (CallSiteId id = 1; id < size_; ++id) {
+				if (predicate(get(id))) {
+					set_enabled(id, enabled);
+				}
+			}
+			enabled_rules.emplace_back(std::move(predicate), enabled);
+		}
+
+		/**
+		 * @brief Like set_enabled, for CallSites whose name matches the glob @p pattern (e.g. `"parse_*"`).
+		 */
+		void set_enabled_by_name(const std::string& pattern, bool enabled) {
+			set_enabled([pattern](const CallSite& callsite) { return glob_match(pattern.c_str(), callsite.name); }, enabled);
+		}
+
+		/**
+		 * @brief Like set_enabled, for CallSites whose file name matches the glob @p pattern (e.g. `"*parser.cpp"`).
+		 */
+		void set_enabled_by_file(const std::string& pattern, bool enabled) {
+			set_enabled([pattern](const CallSite& callsite) { return glob_match(pattern.c_str(), callsite.source_loc.get_file_name()); }, enabled);
+		}
+
+		/**
+		 * @brief Forgets every rule, and enables every CallSite.
+		 */
+		void reset_enabled() {
+			std::lock_guard<std::mutex> lock {mutex};
+			enabled_rules.clear();
+			CallSiteId size_ = size.load(std::memory_order_relaxed);
+			for (CallSiteId id = 0; id < size_; ++id) {
+				set_enabled(id, true);
+			}
+		}
+	};
+
+	/**
+	 * @brief Remembers the CallSite of one SCOPE_TIMER expansion, so only its first call interns.
+	 *
+	 * This is constant-initialized, so a function-local static of it needs no guard.
+	 * The name and SourceLoc are re-checked each call, since ScopeTimerArgs can change them.
+	 */
+	class CallSiteCache {
+	private:
+		std::atomic<const CallSite*> callsite;
+
+	public:
+		constexpr CallSiteCache()
+			: callsite{nullptr}
+		{ }
+
+		const CallSite& get(CallSiteTable& table, const char* name, const SourceLoc& source_loc) {
+			const CallSite* cached = callsite.load(std::memory_order_acquire);
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(cached != nullptr && cached->table == &table && cached->matches(name, source_loc))) {
+				return *cached;
+			}
+			const CallSite& interned = table.intern(name, source_loc);
+			callsite.store(&interned, std::memory_order_release);
+			return interned;
+		}
+
+		CallSiteId get_id(CallSiteTable& table, const char* name, const SourceLoc& source_loc) {
+			return get(table, name, source_loc).id;
+		}
+	};
+
+	/**
+	 * @brief The CallSiteTable which every Process shares, and which Timers name their frames from.
+	 *
+	 * It is never destroyed, so a Timer can be named even after its Process is gone.
+	 * Like the Process anchor (see global_state.hpp), every translation unit and shared library binds to one copy.
+	 */
+	CHARMONIUM_SCOPE_TIMER_EXPORT inline CallSiteTable& get_shared_callsites() {
+		static CallSiteTable* callsites = new CallSiteTable; // NOLINT(cppcoreguidelines-owning-memory)
+		return *callsites;
+	}
+
+} // namespace charmonium::scope_timer::detail
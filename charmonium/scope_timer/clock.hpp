@@ -1,9 +1,27 @@
 #pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
 #include <chrono>
+#include <cstdint>
 #include <ctime>
+#include <mutex>
 #include <system_error>
 #include <type_traits>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CHARMONIUM_SCOPE_TIMER_HAS_TSC 1
+#else
+#define CHARMONIUM_SCOPE_TIMER_HAS_TSC 0
+#endif
+
+/*
+ * Define this to 0 to always stamp frames with CLOCK_MONOTONIC.
+ * Otherwise, the TSC is used when the CPU advertises an invariant TSC.
+ */
+#ifndef CHARMONIUM_SCOPE_TIMER_USE_TSC
+#define CHARMONIUM_SCOPE_TIMER_USE_TSC 1
+#endif
+
 namespace charmonium::scope_timer::detail {
 	/**
 	 * @brief Process-synchronized, monotonic wall time since process start.
@@ -41,6 +59,225 @@ namespace charmonium::scope_timer::detail {
 		return t.count();
 	}
 
+	/**
+	 * @brief A raw, unconverted wall-clock reading.
+	 *
+	 * Depending on the WallClock, this is either TSC ticks or CLOCK_MONOTONIC nanoseconds.
+	 * 0 is reserved for "not yet stamped."
+	 */
+	using WallStamp = uint64_t;
+
+#if CHARMONIUM_SCOPE_TIMER_HAS_TSC
+	/**
+	 * @brief Read the TSC after all prior instructions have completed.
+	 */
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdtsc() {
+		uint32_t lo = 0;
+		uint32_t hi = 0;
+		// NOLINTNEXTLINE(hicpp-no-assembler)
+		__asm__ __volatile__ ("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+		return static_cast<uint64_t>(hi) << 32U | lo;
+	}
+
+	/**
+	 * @brief Read the TSC before any subsequent instructions begin.
+	 *
+	 * @p aux receives IA32_TSC_AUX, which Linux sets to (numa_node << 12 | cpu).
+	 */
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdtscp(uint32_t& aux) {
+		uint32_t lo = 0;
+		uint32_t hi = 0;
+		// NOLINTNEXTLINE(hicpp-no-assembler)
+		__asm__ __volatile__ ("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi), "=c" (aux) : : "memory");
+		return static_cast<uint64_t>(hi) << 32U | lo;
+	}
+
+	/**
+	 * @brief If the TSC ticks at a constant rate, even across P-, C-, and T-states.
+	 *
+	 * See Intel SDM Vol. 3B 17.17.1 "Invariant TSC" (CPUID.80000007H:EDX[8]).
+	 * rdtscp (CPUID.80000001H:EDX[27]) is required too, since the stop-stamp uses it.
+	 */
+	CHARMONIUM_SCOPE_TIMER_UNUSED static bool has_invariant_tsc() {
+		static constexpr unsigned int INVARIANT_TSC_BIT = 1U << 8U;
+		static constexpr unsigned int RDTSCP_BIT = 1U << 27U;
+		unsigned int eax = 0;
+		unsigned int ebx = 0;
+		unsigned int ecx = 0;
+		unsigned int edx = 0;
+		if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) == 0 || (edx & RDTSCP_BIT) == 0) {
+			return false;
+		}
+		if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+			return false;
+		}
+		return (edx & INVARIANT_TSC_BIT) != 0;
+	}
+#else
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdtsc() { return 0; }
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdtscp(uint32_t& aux) { aux = 0; return 0; }
+	CHARMONIUM_SCOPE_TIMER_UNUSED static bool has_invariant_tsc() { return false; }
+#endif
+
+	enum class WallClockSource {
+		monotonic,
+		tsc,
+	};
+
+	/**
+	 * @brief Stamps frames cheaply, and converts those stamps into WallTime later.
+	 *
+	 * When the source is the TSC, the hot path is just an rdtsc.
+	 * The ticks-per-nanosecond ratio is calibrated against CLOCK_MONOTONIC
+	 * the first time a stamp is converted (usually at drain-time), using
+	 * the reading taken at construction as the other endpoint.
+	 *
+	 * If the TSC is requested but not invariant, this falls back to CLOCK_MONOTONIC.
+	 */
+	class WallClock {
+	public:
+		/**
+		 * @brief The shortest interval the TSC is calibrated over.
+		 *
+		 * If the first conversion happens sooner than this after construction, it busy-waits for the remainder.
+		 */
+		static constexpr int64_t calibration_ns = 10 * 1000 * 1000;
+
+		explicit WallClock(WallClockSource requested)
+			: source{requested == WallClockSource::tsc && has_invariant_tsc() ? WallClockSource::tsc : WallClockSource::monotonic}
+			, start{0}
+			, start_stamp{0}
+		{
+			calibration_point(start, start_stamp);
+		}
+
+		WallClockSource get_source() const { return source; }
+
+		/**
+		 * @brief CLOCK_MONOTONIC when this clock was constructed.
+		 */
+		WallTime get_start() const { return start; }
+
+		/**
+		 * @brief A stamp suitable for the start of a frame.
+		 */
+		WallStamp stamp_start() const {
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(source == WallClockSource::tsc)) {
+				return rdtsc();
+			}
+			return static_cast<WallStamp>(wall_now().count());
+		}
+
+		/**
+		 * @brief A stamp suitable for the end of a frame.
+		 *
+		 * Unlike stamp_start, this waits for the frame's instructions to retire.
+		 */
+		WallStamp stamp_stop() const {
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(source == WallClockSource::tsc)) {
+				uint32_t aux = 0;
+				return rdtscp(aux);
+			}
+			return static_cast<WallStamp>(wall_now().count());
+		}
+
+		/**
+		 * @brief Convert @p stamp to time since this clock was constructed.
+		 */
+		WallTime since_start(WallStamp stamp) const {
+			if (source == WallClockSource::tsc) {
+				std::call_once(calibration, [this] { calibrate(); });
+				auto ticks = static_cast<double>(static_cast<int64_t>(stamp - start_stamp));
+				return WallTime{static_cast<int64_t>(ticks * ns_per_tick)};
+			}
+			return WallTime{static_cast<int64_t>(stamp)} - start;
+		}
+
+		/**
+		 * @brief Convert the difference of two stamps to a duration.
+		 */
+		WallTime to_duration(WallStamp stamps) const {
+			if (source == WallClockSource::tsc) {
+				std::call_once(calibration, [this] { calibrate(); });
+				return WallTime{static_cast<int64_t>(static_cast<double>(stamps) * ns_per_tick)};
+			}
+			return WallTime{static_cast<int64_t>(stamps)};
+		}
+
+		/**
+		 * @brief Convert a duration to the difference of two stamps; the inverse of to_duration.
+		 */
+		WallStamp to_stamps(WallTime duration) const {
+			if (source == WallClockSource::tsc) {
+				std::call_once(calibration, [this] { calibrate(); });
+				return static_cast<WallStamp>(static_cast<double>(duration.count()) / ns_per_tick);
+			}
+			return static_cast<WallStamp>(duration.count());
+		}
+
+		double get_ns_per_tick() const {
+			if (source == WallClockSource::tsc) {
+				std::call_once(calibration, [this] { calibrate(); });
+			}
+			return ns_per_tick;
+		}
+
+	private:
+		WallClockSource source;
+		WallTime start;
+		WallStamp start_stamp;
+		mutable std::once_flag calibration;
+		mutable double ns_per_tick {1.0};
+
+		/*
+		 * Reads CLOCK_MONOTONIC and the TSC "at the same time."
+		 * I bracket the clock_gettime between two TSC reads, and use the midpoint.
+		 */
+		void calibration_point(WallTime& wall, WallStamp& stamp) const {
+			if (source == WallClockSource::tsc) {
+				WallStamp before = rdtsc();
+				wall = wall_now();
+				WallStamp after = rdtsc();
+				stamp = before + (after - before) / 2;
+			} else {
+				wall = wall_now();
+				stamp = static_cast<WallStamp>(wall.count());
+			}
+		}
+
+		void calibrate() const {
+			WallTime wall {0};
+			WallStamp stamp {0};
+			do {
+				calibration_point(wall, stamp);
+			} while (get_ns(wall - start) < static_cast<size_t>(calibration_ns));
+			ns_per_tick = static_cast<double>((wall - start).count()) / static_cast<double>(stamp - start_stamp);
+		}
+	};
+
+	/**
+	 * @brief Which clocks every Timer reads and stores.
+	 *
+	 * Select one of the aliases below with CHARMONIUM_SCOPE_TIMER_CLOCK_POLICY.
+	 * Every translation unit and library in the process must agree, since they share one Process.
+	 */
+	template <bool wall_, bool cpu_>
+	struct ClockPolicyOf {
+		static constexpr bool wall = wall_;
+		static constexpr bool cpu = cpu_;
+	};
+
+	using WallAndCpuClocks = ClockPolicyOf<true, true>;
+	using WallClockOnly = ClockPolicyOf<true, false>;
+	using CpuClockOnly = ClockPolicyOf<false, true>;
+	using NoClocks = ClockPolicyOf<false, false>;
+
+#ifndef CHARMONIUM_SCOPE_TIMER_CLOCK_POLICY
+#define CHARMONIUM_SCOPE_TIMER_CLOCK_POLICY WallAndCpuClocks
+#endif
+
+	using ClockPolicy = CHARMONIUM_SCOPE_TIMER_CLOCK_POLICY;
+
 	/*
 	  CpuTime and WallTime happen to be synonyms right now, so this is a duplicate definition.
 	static size_t get_ns(CpuTime t) {
@@ -48,4 +285,15 @@ namespace charmonium::scope_timer::detail {
 	}
 	*/
 
+	/**
+	 * @brief The WallClock which every Process shares, and which Timers convert their stamps with.
+	 *
+	 * It is never destroyed, so a Timer's stamps can be converted even after its Process is gone.
+	 * Like the Process anchor (see global_state.hpp), every translation unit and shared library binds to one copy.
+	 */
+	CHARMONIUM_SCOPE_TIMER_EXPORT inline const WallClock& get_shared_wall_clock() {
+		static const WallClock* wall_clock = new WallClock{CHARMONIUM_SCOPE_TIMER_USE_TSC ? WallClockSource::tsc : WallClockSource::monotonic}; // NOLINT(cppcoreguidelines-owning-memory)
+		return *wall_clock;
+	}
+
 } // namespace scope_timer::detail
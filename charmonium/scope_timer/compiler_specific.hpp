@@ -3,8 +3,10 @@
 #define CHARMONIUM_SCOPE_TIMER_LIKELY(x)      __builtin_expect(!!(x), 1)
 #define CHARMONIUM_SCOPE_TIMER_UNLIKELY(x)    __builtin_expect(!!(x), 0)
 #define CHARMONIUM_SCOPE_TIMER_UNUSED         [[maybe_unused]]
+#define CHARMONIUM_SCOPE_TIMER_EXPORT         __attribute__((visibility("default")))
 #else
 #define CHARMONIUM_SCOPE_TIMER_LIKELY(x)      x
 #define CHARMONIUM_SCOPE_TIMER_UNLIKELY(x)    x
 #define CHARMONIUM_SCOPE_TIMER_UNUSED
+#define CHARMONIUM_SCOPE_TIMER_EXPORT
 #endif
@@ -5,12 +5,31 @@
 #include "process.hpp"
 #include "util.hpp"
 #include <memory>
-#include <fstream>
-#include <string>
+#include <mutex>
 #include <thread>
 
 namespace charmonium::scope_timer::detail {
 
+	/*
+	  Every translation unit, in every shared library, has its own ProcessContainer,
+	  but they should all share one Process.
+	  They meet at this anchor: a static local of an inline function with default visibility,
+	  so the linker and the dynamic loader bind every copy to the first one.
+	  GCC emits it as a unique (STB_GNU_UNIQUE) symbol, so this holds even for libraries dlopen'ed with RTLD_LOCAL.
+	  Initializing it is thread-safe (even under concurrent dlopen), and looking it up costs no syscalls.
+	  It is never destroyed, so containers torn down late at exit can still reach it.
+	 */
+	struct ProcessAnchor {
+		std::mutex mutex;
+		// Weak, so the Process dies with the last container, as the containers' statics do.
+		std::weak_ptr<Process> process; // locked by mutex
+	};
+
+	CHARMONIUM_SCOPE_TIMER_EXPORT inline ProcessAnchor& get_process_anchor() {
+		static ProcessAnchor* anchor = new ProcessAnchor; // NOLINT(cppcoreguidelines-owning-memory)
+		return *anchor;
+	}
+
 	/*
 	  I want to hold a process with a static lifetime.
 	  I don't want anyone to access it directly.
@@ -19,46 +38,24 @@ namespace charmonium::scope_timer::detail {
 	 */
 	static class ProcessContainer {
 	private:
-		std::string filename;
 		std::shared_ptr<Process> process;
 
 		/*
-		  This may need to lookup the address of the process,
-		  so it can't return a shared_ptr; it has to mutate the container.
+		  Another container (maybe in another library) may have created the process already,
+		  so this looks it up in the anchor before creating it.
 		 */
 		void create_or_lookup_process() {
-			std::ifstream infile {filename};
-			if (CHARMONIUM_SCOPE_TIMER_LIKELY(infile.good())) {
-				uintptr_t intptr = 0;
-				infile >> intptr;
-				// std::cerr << "ProcessContainer::create_or_lookup_process() lookup got " << reinterpret_cast<void*>(intptr) << " from " << filename << "\n";
-				assert(intptr);
-				// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-				process = *reinterpret_cast<std::shared_ptr<Process>*>(intptr);
-			} else {
-				infile.close();
+			ProcessAnchor& anchor = get_process_anchor();
+			std::lock_guard<std::mutex> anchor_lock {anchor.mutex};
+			process = anchor.process.lock();
+			if (!process) {
 				process = std::make_shared<Process>();
-				std::ofstream outfile {filename};
-				// NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
-				uintptr_t intptr = reinterpret_cast<uintptr_t>(&process);
-				// std::cerr << "ProcessContainer::create_or_lookup_process() create put " << reinterpret_cast<void*>(intptr) << " into " << filename << "\n";
-				outfile << intptr;
+				anchor.process = process;
 			}
 		}
 
 	public:
-		ProcessContainer()
-			: filename{tmp_path(std::to_string(get_pid()) + "_" + std::to_string(get_pid_uniquifier()))}
-		{
-			// std::cerr << "ProcessContainer::ProcessContainer()\n";
-		}
-		~ProcessContainer() {
-			// std::cerr << "ProcessContainer::~ProcessContainer()\n";
-			if (process.unique()) {
-				[[maybe_unused]] auto rc = std::remove(filename.c_str());
-				assert(rc == 0);
-			}
-		}
+		ProcessContainer() = default;
 		Process& get_process() {
 			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(!process)) {
 				create_or_lookup_process();
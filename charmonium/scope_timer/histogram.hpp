@@ -0,0 +1,421 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief Counts of durations in log-linear (HDR-style) buckets.
+	 *
+	 * Values below 2^sub_bucket_bits have a bucket each;
+	 * above, each power of two is split into 2^sub_bucket_bits buckets, so a bucket is at most 1/16 as wide as its values.
+	 * Values from 2^max_bits saturate into the last bucket.
+	 * Histograms merge by adding, and a later snapshot minus an earlier one is the histogram of the window between them.
+	 */
+	class Histogram {
+	public:
+		static constexpr unsigned sub_bucket_bits = 4;
+		static constexpr unsigned max_bits = 40;
+		static constexpr size_t num_buckets = size_t{max_bits - sub_bucket_bits + 1} << sub_bucket_bits;
+
+		static size_t bucket_of(uint64_t value) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(value >= (uint64_t{1} << max_bits))) {
+				return num_buckets - 1;
+			}
+			if (value < (uint64_t{1} << sub_bucket_bits)) {
+				return static_cast<size_t>(value);
+			}
+			unsigned msb = 63U - static_cast<unsigned>(__builtin_clzll(value));
+			unsigned shift = msb - sub_bucket_bits;
+			return (size_t{shift + 1} << sub_bucket_bits) + static_cast<size_t>((value >> shift) - (uint64_t{1} << sub_bucket_bits));
+		}
+
+		/**
+		 * @brief The smallest value in @p bucket.
+		 */
+		static uint64_t bucket_lower(size_t bucket) {
+			size_t group = bucket >> sub_bucket_bits;
+			uint64_t sub_bucket = bucket & ((size_t{1} << sub_bucket_bits) - 1);
+			return group == 0 ? sub_bucket : ((uint64_t{1} << sub_bucket_bits) + sub_bucket) << (group - 1);
+		}
+
+		/**
+		 * @brief One past the largest value in @p bucket.
+		 */
+		static uint64_t bucket_upper(size_t bucket) {
+			size_t group = bucket >> sub_bucket_bits;
+			return bucket_lower(bucket) + (group == 0 ? 1 : uint64_t{1} << (group - 1));
+		}
+
+	private:
+		friend class LatencyRecorder;
+
+		// Empty until the first value, so that unused histograms are small.
+		std::vector<uint64_t> buckets;
+		uint64_t count {0};
+		uint64_t sum {0};
+
+	public:
+		void record(uint64_t value, uint64_t times = 1) {
+			if (buckets.empty()) {
+				buckets.resize(num_buckets);
+			}
+			buckets[bucket_of(value)] += times;
+			count += times;
+			sum += value * times;
+		}
+
+		void merge(const Histogram& other) {
+			if (other.buckets.empty()) {
+				return;
+			}
+			if (buckets.empty()) {
+				buckets.resize(num_buckets);
+			}
+			for (size_t i = 0; i < num_buckets; ++i) {
+				buckets[i] += other.buckets[i];
+			}
+			count += other.count;
+			sum += other.sum;
+		}
+
+		/**
+		 * @brief Removes @p earlier, which should be an earlier snapshot of the same histogram.
+		 */
+		void subtract(const Histogram& earlier) {
+			if (earlier.buckets.empty()) {
+				return;
+			}
+			assert(!buckets.empty() && "earlier should be a snapshot of this histogram");
+			for (size_t i = 0; i < num_buckets; ++i) {
+				buckets[i] -= earlier.buckets[i];
+			}
+			count -= earlier.count;
+			sum -= earlier.sum;
+		}
+
+		uint64_t get_count() const { return count; }
+
+		uint64_t get_sum() const { return sum; }
+
+		uint64_t get_bucket_count(size_t bucket) const { return buckets.empty() ? 0 : buckets[bucket]; }
+
+		/**
+		 * @brief The value below which a fraction @p q of the values fall (e.g. 0.99 for p99), or 0 if empty.
+		 *
+		 * This is the midpoint of the value's bucket, so it is within 1/32 of the true value.
+		 */
+		uint64_t get_quantile(double q) const {
+			if (count == 0) {
+				return 0;
+			}
+			auto rank = static_cast<uint64_t>(std::ceil(std::min(std::max(q, 0.0), 1.0) * static_cast<double>(count)));
+			rank = std::max(rank, uint64_t{1});
+			uint64_t seen = 0;
+			for (size_t i = 0; i < num_buckets; ++i) {
+				seen += buckets[i];
+				if (seen >= rank) {
+					return bucket_lower(i) + (bucket_upper(i) - bucket_lower(i) - 1) / 2;
+				}
+			}
+			return bucket_lower(num_buckets - 1);
+		}
+	};
+
+	/**
+	 * @brief Histograms of the durations of one CallSite's frames.
+	 */
+	class CallSiteLatency {
+	private:
+		friend class LatencyRecorder;
+
+		Histogram cpu;
+		// In WallClock stamps.
+		Histogram wall;
+		uint64_t cpu_exclusive {0};
+		WallStamp wall_exclusive {0};
+
+	public:
+		/**
+		 * @brief The number of frames which finished.
+		 */
+		uint64_t get_count() const { return cpu.get_count(); }
+
+		/**
+		 * @brief The CPU time below which a fraction @p q of the frames fall (e.g. 0.99 for p99).
+		 */
+		CpuTime get_cpu_quantile(double q) const { return CpuTime{static_cast<int64_t>(cpu.get_quantile(q))}; }
+
+		/**
+		 * @brief The wall time below which a fraction @p q of the frames fall.
+		 */
+		WallTime get_wall_quantile(double q) const { return get_shared_wall_clock().to_duration(wall.get_quantile(q)); }
+
+		CpuTime get_cpu_total() const { return CpuTime{static_cast<int64_t>(cpu.get_sum())}; }
+		WallTime get_wall_total() const { return get_shared_wall_clock().to_duration(wall.get_sum()); }
+
+		/**
+		 * @brief The CPU time of the frames not spent in their children (see Timer::get_exclusive_cpu).
+		 */
+		CpuTime get_cpu_exclusive_total() const { return CpuTime{static_cast<int64_t>(cpu_exclusive)}; }
+		WallTime get_wall_exclusive_total() const { return get_shared_wall_clock().to_duration(wall_exclusive); }
+
+		/**
+		 * @brief CPU durations in nanoseconds.
+		 */
+		const Histogram& get_cpu_histogram() const { return cpu; }
+
+		/**
+		 * @brief Wall durations in WallClock stamps (see WallClock::to_duration).
+		 */
+		const Histogram& get_wall_histogram() const { return wall; }
+
+		void merge(const CallSiteLatency& other) {
+			cpu.merge(other.cpu);
+			wall.merge(other.wall);
+			cpu_exclusive += other.cpu_exclusive;
+			wall_exclusive += other.wall_exclusive;
+		}
+
+		void subtract(const CallSiteLatency& earlier) {
+			cpu.subtract(earlier.cpu);
+			wall.subtract(earlier.wall);
+			cpu_exclusive -= earlier.cpu_exclusive;
+			wall_exclusive -= earlier.wall_exclusive;
+		}
+	};
+
+	/**
+	 * @brief CallSiteLatency of every CallSite, indexed by CallSiteId; CallSites which never finished a frame may be missing.
+	 */
+	class Latencies {
+	private:
+		std::vector<CallSiteLatency> callsites;
+
+	public:
+		/**
+		 * @brief The histograms for @p callsite, which are empty if it never finished a frame.
+		 */
+		const CallSiteLatency& operator[](CallSiteId callsite) const {
+			static const CallSiteLatency empty;
+			return callsite < callsites.size() ? callsites[callsite] : empty;
+		}
+
+		CallSiteLatency& at(CallSiteId callsite) {
+			if (callsite >= callsites.size()) {
+				callsites.resize(callsite + 1);
+			}
+			return callsites[callsite];
+		}
+
+		size_t size() const { return callsites.size(); }
+
+		void merge(const Latencies& other) {
+			for (CallSiteId callsite = 0; callsite < other.size(); ++callsite) {
+				if (other[callsite].get_count() != 0) {
+					at(callsite).merge(other[callsite]);
+				}
+			}
+		}
+
+		/**
+		 * @brief Leaves the frames which finished after @p earlier, an earlier snapshot of the same threads.
+		 */
+		void subtract(const Latencies& earlier) {
+			for (CallSiteId callsite = 0; callsite < earlier.size(); ++callsite) {
+				if (earlier[callsite].get_count() != 0) {
+					at(callsite).subtract(earlier[callsite]);
+				}
+			}
+		}
+	};
+
+	/**
+	 * @brief Latency histograms per CallSite, recorded by one thread at a time without locks (see Process::set_latency_histograms).
+	 *
+	 * Only the thread it is lent to (see LatencyRecorders) records, so each counter is a plain load and store, not a read-modify-write.
+	 * Any thread may read, which adds the counts so far to a Latencies.
+	 * Counts only grow; to get a window, subtract an earlier reading.
+	 * The histograms of a CallSite are allocated when it first finishes a frame,
+	 * in fixed-size chunks which are never moved, like CallSiteTable's.
+	 */
+	class LatencyRecorder {
+	private:
+		friend class LatencyRecorders;
+
+		static constexpr size_t chunk_bits = 10;
+		static constexpr size_t chunk_size = size_t{1} << chunk_bits;
+		static constexpr size_t max_chunks = 4096;
+
+		struct Counts {
+			std::array<std::atomic<uint64_t>, Histogram::num_buckets> buckets;
+			std::atomic<uint64_t> sum;
+			std::atomic<uint64_t> exclusive_sum;
+
+			void record(uint64_t value, uint64_t exclusive) {
+				std::atomic<uint64_t>& bucket = buckets[Histogram::bucket_of(value)];
+				bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+				exclusive_sum.store(exclusive_sum.load(std::memory_order_relaxed) + exclusive, std::memory_order_relaxed);
+			}
+
+			void read(Histogram& into, uint64_t& exclusive_into) const {
+				if (into.buckets.empty()) {
+					into.buckets.resize(Histogram::num_buckets);
+				}
+				// The count is summed from the buckets, so it agrees with them even if the owner is recording.
+				for (size_t i = 0; i < Histogram::num_buckets; ++i) {
+					uint64_t times = buckets[i].load(std::memory_order_relaxed);
+					into.buckets[i] += times;
+					into.count += times;
+				}
+				into.sum += sum.load(std::memory_order_relaxed);
+				exclusive_into += exclusive_sum.load(std::memory_order_relaxed);
+			}
+		};
+
+		struct Slot {
+			Counts cpu;
+			Counts wall;
+		};
+
+		using Chunk = std::array<std::atomic<Slot*>, chunk_size>;
+
+		std::array<std::atomic<Chunk*>, max_chunks> chunks;
+		// See LatencyRecorders.
+		LatencyRecorder* next {nullptr};
+		std::atomic<bool> lent {true};
+
+		Slot* get_slot(CallSiteId callsite) const {
+			Chunk* chunk = chunks[callsite >> chunk_bits].load(std::memory_order_acquire);
+			return chunk == nullptr ? nullptr : (*chunk)[callsite & (chunk_size - 1)].load(std::memory_order_acquire);
+		}
+
+	public:
+		LatencyRecorder() {
+			for (auto& chunk : chunks) {
+				chunk.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+
+		~LatencyRecorder() {
+			for (auto& chunk : chunks) {
+				Chunk* chunk_ = chunk.load(std::memory_order_relaxed);
+				if (chunk_ != nullptr) {
+					for (auto& slot : *chunk_) {
+						delete slot.load(std::memory_order_relaxed);
+					}
+					delete chunk_;
+				}
+			}
+		}
+
+		LatencyRecorder(const LatencyRecorder&) = delete;
+		LatencyRecorder& operator=(const LatencyRecorder&) = delete;
+		LatencyRecorder(LatencyRecorder&&) = delete;
+		LatencyRecorder& operator=(LatencyRecorder&&) = delete;
+
+		/**
+		 * @brief Counts a finished frame, given its inclusive and exclusive durations. Only the owning thread may call this.
+		 */
+		void record(CallSiteId callsite, CpuTime cpu, CpuTime cpu_exclusive, WallStamp wall, WallStamp wall_exclusive) {
+			Slot* slot = get_slot(callsite);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(slot == nullptr)) {
+				std::atomic<Chunk*>& chunk = chunks.at(callsite >> chunk_bits);
+				if (chunk.load(std::memory_order_relaxed) == nullptr) {
+					// Value-initialization zeroes the atomics.
+					chunk.store(new Chunk(), std::memory_order_release);
+				}
+				slot = new Slot();
+				(*chunk.load(std::memory_order_relaxed))[callsite & (chunk_size - 1)].store(slot, std::memory_order_release);
+			}
+			slot->cpu.record(static_cast<uint64_t>(get_ns(cpu)), static_cast<uint64_t>(get_ns(cpu_exclusive)));
+			slot->wall.record(wall, wall_exclusive);
+		}
+
+		/**
+		 * @brief Adds the counts so far to @p into. This may be called from any thread.
+		 */
+		void read(Latencies& into) const {
+			for (size_t i = 0; i < max_chunks; ++i) {
+				Chunk* chunk = chunks[i].load(std::memory_order_acquire);
+				if (chunk == nullptr) {
+					continue;
+				}
+				for (size_t j = 0; j < chunk_size; ++j) {
+					Slot* slot = (*chunk)[j].load(std::memory_order_acquire);
+					if (slot != nullptr) {
+						CallSiteLatency& latency = into.at(static_cast<CallSiteId>((i << chunk_bits) + j));
+						slot->cpu.read(latency.cpu, latency.cpu_exclusive);
+						slot->wall.read(latency.wall, latency.wall_exclusive);
+					}
+				}
+			}
+		}
+	};
+
+	/**
+	 * @brief The LatencyRecorders of a Process, lent to its threads.
+	 *
+	 * Recorders' counts are only ever summed, never reset, so when a thread exits, its recorder is lent to the next thread,
+	 * counts and all; the exiting thread hands nothing off, so readers never miss or double-count it.
+	 * Recorders are only ever pushed onto the list, so reading and lending take no locks,
+	 * and there are as many as the most threads which recorded at once.
+	 */
+	class LatencyRecorders {
+	private:
+		std::atomic<LatencyRecorder*> head {nullptr};
+
+	public:
+		LatencyRecorders() = default;
+
+		~LatencyRecorders() {
+			LatencyRecorder* recorder = head.load(std::memory_order_acquire);
+			while (recorder != nullptr) {
+				LatencyRecorder* next = recorder->next;
+				delete recorder;
+				recorder = next;
+			}
+		}
+
+		LatencyRecorders(const LatencyRecorders&) = delete;
+		LatencyRecorders& operator=(const LatencyRecorders&) = delete;
+		LatencyRecorders(LatencyRecorders&&) = delete;
+		LatencyRecorders& operator=(LatencyRecorders&&) = delete;
+
+		/**
+		 * @brief A recorder which only the calling thread will record into, until it calls give_back.
+		 */
+		LatencyRecorder* lend() {
+			for (LatencyRecorder* recorder = head.load(std::memory_order_acquire); recorder != nullptr; recorder = recorder->next) {
+				bool lent = false;
+				if (!recorder->lent.load(std::memory_order_relaxed) && recorder->lent.compare_exchange_strong(lent, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+					return recorder;
+				}
+			}
+			auto* recorder = new LatencyRecorder;
+			recorder->next = head.load(std::memory_order_relaxed);
+			while (!head.compare_exchange_weak(recorder->next, recorder, std::memory_order_release, std::memory_order_relaxed)) { }
+			return recorder;
+		}
+
+		void give_back(LatencyRecorder* recorder) { recorder->lent.store(false, std::memory_order_release); }
+
+		/**
+		 * @brief Adds the counts of every recorder to @p into. This may be called from any thread.
+		 */
+		void read(Latencies& into) const {
+			for (LatencyRecorder* recorder = head.load(std::memory_order_acquire); recorder != nullptr; recorder = recorder->next) {
+				recorder->read(into);
+			}
+		}
+	};
+
+} // namespace charmonium::scope_timer::detail
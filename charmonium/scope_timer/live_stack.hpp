@@ -0,0 +1,168 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/*
+ * Define this to 1 to publish each thread's open frames for Process::sample_stacks.
+ * Otherwise timed frames skip the LiveStack, and cost nothing for it (sampling mode still uses it).
+ */
+#ifndef CHARMONIUM_SCOPE_TIMER_LIVE_STACK
+#define CHARMONIUM_SCOPE_TIMER_LIVE_STACK 0
+#endif
+
+#ifndef CHARMONIUM_SCOPE_TIMER_LIVE_STACK_DEPTH
+#define CHARMONIUM_SCOPE_TIMER_LIVE_STACK_DEPTH 64
+#endif
+
+namespace charmonium::scope_timer::detail {
+
+	static constexpr bool use_live_stack = CHARMONIUM_SCOPE_TIMER_LIVE_STACK != 0;
+
+	/**
+	 * @brief A frame which has started but not yet finished, as seen from another thread.
+	 */
+	struct LiveFrame {
+		CallSiteId callsite;
+		WallStamp start_wall;
+		CpuTime start_cpu;
+
+		CallSiteId get_callsite_id() const { return callsite; }
+		const char* get_name() const { return get_shared_callsites().get(callsite).name; }
+		const SourceLoc& get_source_loc() const { return get_shared_callsites().get(callsite).source_loc; }
+
+		/**
+		 * @brief Wall time from the start of the process to the start of this frame (0 if wall time is not recorded).
+		 */
+		WallTime get_start_wall() const {
+			return start_wall == 0 ? WallTime{0} : get_shared_wall_clock().since_start(start_wall);
+		}
+
+		/**
+		 * @brief The owning thread's CPU time at the start of this frame (0 if CPU time is not recorded).
+		 */
+		CpuTime get_start_cpu() const { return start_cpu; }
+	};
+
+	/**
+	 * @brief The open frames of one Thread, which any thread may read while the owner runs.
+	 *
+	 * Only the owning thread writes. A push is bracketed by a sequence counter (a seqlock),
+	 * so readers retry instead of seeing a half-written slot; writers never wait.
+	 * A pop only lowers the depth, which leaves the remaining slots consistent, so it skips the counter.
+	 * Frames deeper than max_depth are counted but not published.
+	 */
+	class LiveStack {
+	public:
+		static constexpr size_t max_depth = CHARMONIUM_SCOPE_TIMER_LIVE_STACK_DEPTH;
+
+	private:
+		struct Slot {
+			std::atomic<CallSiteId> callsite {0};
+			std::atomic<WallStamp> start_wall {0};
+			std::atomic<int64_t> start_cpu {0};
+		};
+
+		std::atomic<uint32_t> sequence {0};
+		std::atomic<size_t> depth {0};
+		Slot slots[max_depth];
+
+	public:
+		LiveStack() = default;
+		LiveStack(const LiveStack&) = delete;
+		LiveStack& operator=(const LiveStack&) = delete;
+		LiveStack& operator=(LiveStack&&) = delete;
+
+		/*
+		 * Not thread-safe; only for moving a Thread before it is shared.
+		 */
+		LiveStack(LiveStack&& other) noexcept
+			: sequence{other.sequence.load(std::memory_order_relaxed)}
+			, depth{other.depth.load(std::memory_order_relaxed)}
+		{
+			for (size_t i = 0; i < max_depth; ++i) {
+				slots[i].callsite.store(other.slots[i].callsite.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				slots[i].start_wall.store(other.slots[i].start_wall.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				slots[i].start_cpu.store(other.slots[i].start_cpu.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			}
+		}
+
+		~LiveStack() = default;
+
+		/**
+		 * @brief Publishes a frame which just started. Only the owning thread may call this.
+		 */
+		void push(CallSiteId callsite, WallStamp start_wall, CpuTime start_cpu) {
+			size_t depth_ = depth.load(std::memory_order_relaxed);
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(depth_ < max_depth)) {
+				uint32_t sequence_ = sequence.load(std::memory_order_relaxed);
+				sequence.store(sequence_ + 1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				slots[depth_].callsite.store(callsite, std::memory_order_relaxed);
+				slots[depth_].start_wall.store(start_wall, std::memory_order_relaxed);
+				slots[depth_].start_cpu.store(start_cpu.count(), std::memory_order_relaxed);
+				// Release, so a signal handler which sees the new depth sees the whole slot.
+				depth.store(depth_ + 1, std::memory_order_release);
+				sequence.store(sequence_ + 2, std::memory_order_release);
+			} else {
+				depth.store(depth_ + 1, std::memory_order_release);
+			}
+		}
+
+		/**
+		 * @brief Retracts the youngest frame. Only the owning thread may call this.
+		 */
+		void pop() {
+			depth.store(depth.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+		}
+
+		/**
+		 * @brief Copies the open frames, oldest first, into @p frames; returns the true depth.
+		 *
+		 * This may be called from any thread. It retries while the owner is mid-push,
+		 * so the frames are a state which the stack was actually in.
+		 */
+		size_t read(std::vector<LiveFrame>& frames) const {
+			for (size_t attempt = 0; ; ++attempt) {
+				uint32_t before = sequence.load(std::memory_order_acquire);
+				if (CHARMONIUM_SCOPE_TIMER_LIKELY((before & 1U) == 0)) {
+					size_t depth_ = depth.load(std::memory_order_acquire);
+					size_t published = depth_ < max_depth ? depth_ : max_depth;
+					frames.clear();
+					for (size_t i = 0; i < published; ++i) {
+						frames.push_back(LiveFrame{
+							slots[i].callsite.load(std::memory_order_relaxed),
+							slots[i].start_wall.load(std::memory_order_relaxed),
+							CpuTime{slots[i].start_cpu.load(std::memory_order_relaxed)},
+						});
+					}
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (sequence.load(std::memory_order_relaxed) == before) {
+						return depth_;
+					}
+				}
+				if (attempt > 16) {
+					// The owner was likely descheduled mid-push.
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		/**
+		 * @brief The CallSite of the open frame at @p depth_ (which must be published).
+		 *
+		 * Only the owning thread (or its signal handler) may call this, since it does not check the sequence.
+		 */
+		CallSiteId get_callsite(size_t depth_) const { return slots[depth_].callsite.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief The number of open frames, including the root and any beyond max_depth.
+		 */
+		size_t get_depth() const { return depth.load(std::memory_order_acquire); }
+	};
+
+} // namespace charmonium::scope_timer::detail
@@ -0,0 +1,443 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "clock.hpp"
+#include "compiler_specific.hpp"
+#include "os_specific.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Define this to 0 to never call perf_event_open.
+ * Otherwise, perf_event_open is tried, and if it is denied, we fall back on syscalls.
+ */
+#ifndef CHARMONIUM_SCOPE_TIMER_USE_PERF_EVENT
+#define CHARMONIUM_SCOPE_TIMER_USE_PERF_EVENT 1
+#endif
+
+/*
+ * The number of hardware counters each Timer can store.
+ * 0 (the default) removes them from Timer entirely.
+ */
+#ifndef CHARMONIUM_SCOPE_TIMER_MAX_COUNTERS
+#define CHARMONIUM_SCOPE_TIMER_MAX_COUNTERS 0
+#endif
+
+/*
+ * Define this to 1 to record voluntary and involuntary context switches, migrations, page faults, and the CPU id in every Timer.
+ */
+#ifndef CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS
+#define CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS 0
+#endif
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief An owned perf_event file descriptor measuring the calling thread, and optionally its mmap'ed metadata page.
+	 *
+	 * See [perf_event_open(2)][1].
+	 *
+	 * [1]: https://man7.org/linux/man-pages/man2/perf_event_open.2.html
+	 */
+	class PerfEvent {
+	public:
+		PerfEvent() = default;
+
+		/**
+		 * @brief Opens an event on the calling thread.
+		 *
+		 * If this fails (e.g. perf_event_paranoid, seccomp, or no PMU in a VM), is_open() will be false.
+		 */
+		PerfEvent(uint32_t type, uint64_t config, bool map_page, int group_fd = -1, uint64_t read_format = 0) {
+			if (!CHARMONIUM_SCOPE_TIMER_USE_PERF_EVENT) {
+				return;
+			}
+			struct perf_event_attr attr {};
+			attr.size = sizeof(attr);
+			attr.type = type;
+			attr.config = config;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = read_format;
+			// pid = 0, cpu = -1 means "this thread, on any CPU."
+			fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+			if (fd >= 0 && map_page) {
+				void* addr = ::mmap(nullptr, static_cast<size_t>(::sysconf(_SC_PAGESIZE)), PROT_READ, MAP_SHARED, fd, 0);
+				if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(addr == MAP_FAILED)) {
+					close();
+				} else {
+					page = static_cast<perf_event_mmap_page*>(addr);
+				}
+			}
+		}
+
+		PerfEvent(const PerfEvent&) = delete;
+		PerfEvent& operator=(const PerfEvent&) = delete;
+		PerfEvent(PerfEvent&& other) noexcept
+			: fd{other.fd}
+			, page{other.page}
+		{
+			other.fd = -1;
+			other.page = nullptr;
+		}
+		PerfEvent& operator=(PerfEvent&& other) noexcept {
+			if (this != &other) {
+				close();
+				fd = other.fd;
+				page = other.page;
+				other.fd = -1;
+				other.page = nullptr;
+			}
+			return *this;
+		}
+		~PerfEvent() { close(); }
+
+		bool is_open() const { return fd >= 0; }
+
+		int get_fd() const { return fd; }
+
+		/**
+		 * @brief The metadata page, or nullptr if it was not requested or could not be mapped.
+		 *
+		 * The kernel writes this concurrently; read it under its seqlock (see read_page_seqlock).
+		 */
+		const volatile perf_event_mmap_page* get_page() const { return page; }
+
+		void close() {
+			if (page != nullptr) {
+				::munmap(page, static_cast<size_t>(::sysconf(_SC_PAGESIZE)));
+				page = nullptr;
+			}
+			if (fd >= 0) {
+				::close(fd);
+				fd = -1;
+			}
+		}
+
+	private:
+		int fd {-1};
+		perf_event_mmap_page* page {nullptr};
+	};
+
+	/**
+	 * @brief Runs @p read until the kernel did not update @p page in the middle of it.
+	 */
+	template <typename Read>
+	static void read_page_seqlock(const volatile perf_event_mmap_page* page, Read read) {
+		uint32_t seq = 0;
+		do {
+			seq = page->lock;
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+			read();
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+		} while (CHARMONIUM_SCOPE_TIMER_UNLIKELY(page->lock != seq));
+	}
+
+	/**
+	 * @brief Thread-specific CPU time, read in userspace when possible.
+	 *
+	 * clock_gettime(CLOCK_THREAD_CPUTIME_ID) is not served by the VDSO, so it costs a syscall.
+	 * Instead, this opens a PERF_COUNT_SW_TASK_CLOCK event on the calling thread and reads its mmap'ed page.
+	 * The kernel publishes time_running as of the last time it touched the page, and
+	 * time_offset/time_mult/time_shift to extrapolate from there using the TSC.
+	 * Since the reader *is* the measured thread, it is currently running, so the extrapolation is valid.
+	 *
+	 * If perf_event_open is denied, or the kernel does not set cap_user_time, this falls back on cpu_now().
+	 *
+	 * This must be constructed in the thread it measures.
+	 */
+	class CpuClock {
+	public:
+		/**
+		 * @param try_perf_event whether to open the task-clock event at all (e.g. false if the ClockPolicy never reads CPU time).
+		 */
+		explicit CpuClock(bool try_perf_event = true)
+			: task_clock{try_perf_event ? PerfEvent{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, CHARMONIUM_SCOPE_TIMER_HAS_TSC != 0} : PerfEvent{}}
+			, base{0}
+		{
+			if (task_clock.get_page() == nullptr || task_clock.get_page()->cap_user_time == 0) {
+				task_clock.close();
+			} else {
+				// Shift our readings to be comparable with CLOCK_THREAD_CPUTIME_ID.
+				base = cpu_now() - read_task_clock();
+			}
+		}
+
+		/**
+		 * @brief If this reads CPU time without a syscall.
+		 */
+		bool is_userspace() const { return task_clock.is_open(); }
+
+		CpuTime now() const {
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(is_userspace())) {
+				return base + read_task_clock();
+			}
+			return cpu_now();
+		}
+
+	private:
+		PerfEvent task_clock;
+		CpuTime base;
+
+		CpuTime read_task_clock() const {
+			const volatile perf_event_mmap_page* page = task_clock.get_page();
+			uint64_t running = 0;
+			uint64_t cycles = 0;
+			uint64_t time_offset = 0;
+			uint32_t time_mult = 0;
+			uint16_t time_shift = 0;
+			read_page_seqlock(page, [&] {
+				running = page->time_running;
+				time_offset = page->time_offset;
+				time_mult = page->time_mult;
+				time_shift = page->time_shift;
+				cycles = rdtsc();
+			});
+			// See "cap_user_time" in perf_event_open(2).
+			uint64_t quot = cycles >> time_shift;
+			uint64_t rem = cycles & ((static_cast<uint64_t>(1) << time_shift) - 1);
+			uint64_t delta = time_offset + quot * time_mult + ((rem * time_mult) >> time_shift);
+			return CpuTime{static_cast<int64_t>(running + delta)};
+		}
+	};
+
+	static constexpr size_t max_counters = CHARMONIUM_SCOPE_TIMER_MAX_COUNTERS;
+
+	enum class HardwareCounter {
+		instructions,
+		cycles,
+		llc_misses,
+		branch_misses,
+	};
+
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t get_perf_config(HardwareCounter counter) {
+		switch (counter) {
+		case HardwareCounter::instructions: return PERF_COUNT_HW_INSTRUCTIONS;
+		case HardwareCounter::cycles: return PERF_COUNT_HW_CPU_CYCLES;
+		case HardwareCounter::llc_misses: return PERF_COUNT_HW_CACHE_MISSES;
+		case HardwareCounter::branch_misses: return PERF_COUNT_HW_BRANCH_MISSES;
+		}
+		return PERF_COUNT_HW_INSTRUCTIONS;
+	}
+
+#if CHARMONIUM_SCOPE_TIMER_HAS_TSC
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdpmc(uint32_t counter) {
+		uint32_t lo = 0;
+		uint32_t hi = 0;
+		// NOLINTNEXTLINE(hicpp-no-assembler)
+		__asm__ __volatile__ ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (counter));
+		return static_cast<uint64_t>(hi) << 32U | lo;
+	}
+#else
+	CHARMONIUM_SCOPE_TIMER_UNUSED static uint64_t rdpmc(uint32_t) { return 0; }
+#endif
+
+	/**
+	 * @brief A group of hardware performance counters on the calling thread.
+	 *
+	 * These are read with rdpmc from userspace when the kernel allows it (cap_user_rdpmc),
+	 * and otherwise with one read(2) of the whole group.
+	 * Counters which could not be opened (e.g. no PMU in a VM, or too few PMU registers) always read 0.
+	 *
+	 * This must be constructed in the thread it measures.
+	 */
+	class HardwareCounters {
+	public:
+		using Values = std::array<uint64_t, max_counters>;
+
+		HardwareCounters() = default;
+
+		/**
+		 * @brief Opens the first max_counters of @p config.
+		 */
+		explicit HardwareCounters(const std::vector<HardwareCounter>& config) {
+			int leader_fd = -1;
+			for (size_t i = 0; i < config.size() && i < max_counters; ++i) {
+				kinds[i] = config[i];
+				events[i] = PerfEvent{PERF_TYPE_HARDWARE, get_perf_config(config[i]), true, leader_fd, PERF_FORMAT_GROUP};
+				if (events[i].is_open()) {
+					if (leader_fd == -1) {
+						leader_fd = events[i].get_fd();
+					}
+					group_position[i] = num_open++;
+					use_rdpmc = use_rdpmc && events[i].get_page() != nullptr && events[i].get_page()->cap_user_rdpmc != 0;
+				}
+				++num_configured;
+			}
+			use_rdpmc = use_rdpmc && num_open != 0 && CHARMONIUM_SCOPE_TIMER_HAS_TSC;
+			leader = leader_fd;
+		}
+
+		/**
+		 * @brief The number of counters requested, including unavailable ones.
+		 */
+		size_t size() const { return num_configured; }
+
+		HardwareCounter get_kind(size_t i) const { return kinds.at(i); }
+
+		bool is_available(size_t i) const { return events.at(i).is_open(); }
+
+		/**
+		 * @brief If reads happen without a syscall.
+		 */
+		bool is_userspace() const { return use_rdpmc; }
+
+		void read(Values& values) const {
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(use_rdpmc)) {
+				for (size_t i = 0; i < num_configured; ++i) {
+					values[i] = events[i].is_open() ? read_rdpmc(events[i].get_page()) : 0;
+				}
+			} else if (leader != -1) {
+				// See PERF_FORMAT_GROUP in perf_event_open(2): {nr, value[nr]}.
+				std::array<uint64_t, max_counters + 1> buffer {};
+				if (::read(leader, buffer.data(), sizeof(buffer)) <= 0) {
+					buffer.fill(0);
+				}
+				for (size_t i = 0; i < num_configured; ++i) {
+					values[i] = events[i].is_open() ? buffer[1 + group_position[i]] : 0;
+				}
+			} else {
+				values.fill(0);
+			}
+		}
+
+	private:
+		std::array<PerfEvent, max_counters> events {};
+		std::array<HardwareCounter, max_counters> kinds {};
+		std::array<size_t, max_counters> group_position {};
+		size_t num_configured {0};
+		size_t num_open {0};
+		int leader {-1};
+		bool use_rdpmc {true};
+
+		static uint64_t read_rdpmc(const volatile perf_event_mmap_page* page) {
+			uint64_t count = 0;
+			read_page_seqlock(page, [&] {
+				count = page->offset;
+				uint32_t index = page->index;
+				if (page->cap_user_rdpmc != 0 && index != 0) {
+					// Sign-extend the pmc_width-bit counter.
+					auto shift = static_cast<uint32_t>(64 - page->pmc_width);
+					auto pmc = static_cast<int64_t>(rdpmc(index - 1) << shift) >> shift;
+					count += static_cast<uint64_t>(pmc);
+				}
+			});
+			return count;
+		}
+	};
+
+	static constexpr bool use_sched_events = CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS != 0;
+
+	/**
+	 * @brief Software-event counts which explain the gap between wall time and CPU time.
+	 */
+	struct SchedCounts {
+		/// Switches because the thread blocked (e.g. on I/O or a lock).
+		uint64_t voluntary_switches {0};
+		/// Switches because the thread was descheduled (e.g. its timeslice ran out).
+		uint64_t involuntary_switches {0};
+		uint64_t cpu_migrations {0};
+		uint64_t minor_faults {0};
+		uint64_t major_faults {0};
+
+		SchedCounts operator-(const SchedCounts& other) const {
+			SchedCounts ret;
+			ret.voluntary_switches = voluntary_switches - other.voluntary_switches;
+			ret.involuntary_switches = involuntary_switches - other.involuntary_switches;
+			ret.cpu_migrations = cpu_migrations - other.cpu_migrations;
+			ret.minor_faults = minor_faults - other.minor_faults;
+			ret.major_faults = major_faults - other.major_faults;
+			return ret;
+		}
+	};
+
+	/**
+	 * @brief Scheduler and software events (context switches, CPU migrations, minor and major faults) on the calling thread.
+	 *
+	 * Context switches come from getrusage(RUSAGE_THREAD), which, unlike perf, tells voluntary from involuntary ones.
+	 * The other three events are one perf group, so reading them is a single read(2).
+	 * If perf_event_open is denied, faults also come from getrusage, which has no migration count.
+	 *
+	 * This must be constructed in the thread it measures.
+	 */
+	class SchedEvents {
+	public:
+		/**
+		 * @param try_open whether to open anything at all (e.g. false if Timers do not store sched events).
+		 */
+		explicit SchedEvents(bool try_open = true) {
+			if (!try_open) {
+				return;
+			}
+			static constexpr std::array<uint64_t, num_events> configs {{
+				PERF_COUNT_SW_CPU_MIGRATIONS,
+				PERF_COUNT_SW_PAGE_FAULTS_MIN,
+				PERF_COUNT_SW_PAGE_FAULTS_MAJ,
+			}};
+			for (size_t i = 0; i < num_events; ++i) {
+				events[i] = PerfEvent{PERF_TYPE_SOFTWARE, configs[i], false, events[0].get_fd(), PERF_FORMAT_GROUP};
+				if (!events[i].is_open()) {
+					for (PerfEvent& event : events) {
+						event.close();
+					}
+					break;
+				}
+			}
+			use_rdtscp = has_invariant_tsc();
+		}
+
+		/**
+		 * @brief If this reads migrations and faults from a perf group (rather than getrusage).
+		 */
+		bool is_perf() const { return events[0].is_open(); }
+
+		void read(SchedCounts& counts) const {
+			struct rusage usage {};
+			bool have_usage = ::getrusage(RUSAGE_THREAD, &usage) == 0;
+			if (have_usage) {
+				counts.voluntary_switches = static_cast<uint64_t>(usage.ru_nvcsw);
+				counts.involuntary_switches = static_cast<uint64_t>(usage.ru_nivcsw);
+			}
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(is_perf())) {
+				// See PERF_FORMAT_GROUP in perf_event_open(2): {nr, value[nr]}.
+				std::array<uint64_t, num_events + 1> buffer {};
+				if (::read(events[0].get_fd(), buffer.data(), sizeof(buffer)) > 0) {
+					counts.cpu_migrations = buffer[1];
+					counts.minor_faults = buffer[2];
+					counts.major_faults = buffer[3];
+				}
+			} else if (have_usage) {
+				counts.minor_faults = static_cast<uint64_t>(usage.ru_minflt);
+				counts.major_faults = static_cast<uint64_t>(usage.ru_majflt);
+			}
+		}
+
+		/**
+		 * @brief The CPU this thread is running on.
+		 *
+		 * This uses the TSC_AUX from rdtscp, which Linux sets to the CPU number, and otherwise the getcpu VDSO.
+		 */
+		uint32_t get_cpu_id() const {
+			static constexpr uint32_t CPU_MASK = 0xfff;
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(use_rdtscp)) {
+				uint32_t aux = 0;
+				rdtscp(aux);
+				return aux & CPU_MASK;
+			}
+			return static_cast<uint32_t>(::sched_getcpu());
+		}
+
+	private:
+		static constexpr size_t num_events = 3;
+		std::array<PerfEvent, num_events> events {};
+		bool use_rdtscp {false};
+	};
+
+} // namespace charmonium::scope_timer::detail
@@ -1,19 +1,69 @@
 #pragma once // NOLINT(llvm-header-guard)
 
+#include "os_specific.hpp"
 #include "thread.hpp"
+#include "thread_registry.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
-#include <unordered_map>
+#include <vector>
 
 namespace charmonium::scope_timer::detail {
 
 	class Process;
 	class ScopeTimer;
 
+	/**
+	 * @brief The frames drained from one Thread by the collector.
+	 */
+	struct ThreadBatch {
+		std::thread::id thread_id;
+		std::string thread_name;
+		Timers frames;
+	};
+
+	/**
+	 * @brief The open frames of one Thread, read by Process::sample_stacks.
+	 */
+	struct ThreadSample {
+		std::thread::id thread_id;
+		/// Wall time from the start of the process to when this was read; subtract LiveFrame::get_start_wall for a frame's age.
+		WallTime sampled_wall;
+		/// The open frames, oldest (the thread's root) first, up to LiveStack::max_depth.
+		std::vector<LiveFrame> frames;
+		/// The number of open frames, including any beyond LiveStack::max_depth.
+		size_t depth;
+	};
+
+	/**
+	 * @brief Receives batches from the collector thread (see Process::start_collector).
+	 */
+	class CollectorCallbackType {
+	protected:
+		friend class Process;
+		/**
+		 * @brief Called from the collector thread (or Process::collect) with every nonempty batch of one round.
+		 *
+		 * Calls are serialized.
+		 */
+		virtual void collect(std::vector<ThreadBatch>&&) { }
+	public:
+		virtual ~CollectorCallbackType() = default;
+		CollectorCallbackType(const CollectorCallbackType&) = default;
+		CollectorCallbackType(CollectorCallbackType&&) noexcept { }
+		CollectorCallbackType& operator=(const CollectorCallbackType&) = default;
+		CollectorCallbackType& operator=(CollectorCallbackType&&) noexcept { return *this; }
+		CollectorCallbackType() = default;
+	};
+
 	/**
 	 * @brief All threads in the current process.
 	 *
-	 * This calls callback with one thread's batches of Frames, periodically not sooner than callback_period, in the thread whose functions are in the batch.
+	 * This calls callback with one thread's batches of Frames, when one of its FlushTriggers fires, in the thread whose functions are in the batch.
 	 */
 	class Process {
 	private:
@@ -22,27 +72,173 @@ namespace charmonium::scope_timer::detail {
 
 		// std::atomic<bool> enabled;
 		bool enabled {false};
+		CpuTime sampling_period {0};
+		std::atomic<size_t> rate_limit {0}; // read by every instrumented thread, and may change meanwhile
+		bool latency_histograms {false};
+		// Outlives threads, which give back their recorders.
+		LatencyRecorders latency_recorders;
+		// New threads copy these as they start, so they are locked too.
+		SketchKey sketch_key {nullptr}; // locked by sketches_mutex
+		size_t sketch_max_keys {0}; // locked by sketches_mutex
+		// The sketches of threads which have exited.
+		SketchTable exited_sketches; // locked by sketches_mutex
+		std::mutex sketches_mutex;
+		bool aggregating {false};
+		// The CallTrees of aggregating threads which have exited.
+		CallTree exited_call_tree; // locked by call_tree_mutex
+		std::mutex call_tree_mutex;
 		// std::mutex config_mutex;
-		const WallTime start;
-		CpuTime callback_period {0}; // locked by config_mutex
+		const WallClock& wall_clock;
+		CallSiteTable& callsites;
+		// Every instrumented thread reads these as its frames exit, and they may change meanwhile, so they are atomic.
+		// Each stands alone, so relaxed loads and stores suffice.
+		std::atomic<CpuTime> flush_cpu_period {CpuTime{0}};
+		std::atomic<WallTime> flush_wall_period {WallTime{0}};
+		// flush_wall_period in WallClock stamps, converted once here, so threads compare stamps.
+		std::atomic<WallStamp> flush_wall_stamps {0};
+		std::atomic<size_t> flush_records {0};
+		std::atomic<size_t> flush_bytes {0};
+		std::atomic<size_t> buffer_capacity {0};
+		std::atomic<OverflowPolicy> overflow_policy {OverflowPolicy::drop_newest};
 		std::unique_ptr<CallbackType> callback; // locked by config_mutex
+		std::vector<HardwareCounter> hardware_counters {
+			HardwareCounter::instructions,
+			HardwareCounter::cycles,
+			HardwareCounter::llc_misses,
+			HardwareCounter::branch_misses,
+		};
 		// Actually, I don't need to lock the config
 		// If two threads race to modify the config, the "winner" is already non-deterministic
 		// The callers should synchronize themselves.
 		// If this thread writes while someone else reads, there is no guarantee they hadn't "already read" the values.
 		// The caller should synchronize with the readers.
-		std::unordered_map<std::thread::id, Thread> threads; // locked by threads_mutex
-		std::unordered_map<std::thread::id, size_t> thread_use_count; // locked by threads_mutex
-		mutable std::recursive_mutex threads_mutex;
+		// Wall overheads are in WallClock stamp units, so calibration does not force the WallClock to calibrate.
+		WallStamp overhead_wall_inside {0};
+		WallStamp overhead_wall_outside {0};
+		CpuTime overhead_cpu_inside {0};
+		CpuTime overhead_cpu_outside {0};
+
+		std::unique_ptr<CollectorCallbackType> collector_callback;
+		std::mutex collect_mutex; // held for a whole round, so callbacks are serialized
+		std::mutex collector_mutex;
+		std::condition_variable collector_wakeup;
+		bool collector_running {false}; // locked by collector_mutex
+		WallTime collector_period {0}; // locked by collector_mutex
+		std::vector<ThreadBatch> exited_batches; // locked by collector_mutex
+		std::thread collector;
+
+		// Last, so it is destroyed first: a Thread still registered then uses every member above as it is destroyed.
+		ThreadRegistry threads;
+
+		void run_collector() {
+			std::unique_lock<std::mutex> collector_lock {collector_mutex};
+			while (collector_running) {
+				collector_wakeup.wait_for(collector_lock, collector_period, [this] { return !collector_running; });
+				collector_lock.unlock();
+				// This runs once more after stop_collector, to catch the last frames.
+				collect();
+				collector_lock.lock();
+			}
+		}
+
+		/*
+		 * Called by an exiting Thread, so its last frames reach the collector.
+		 */
+		void hand_off_to_collector(Thread& thread) {
+			std::lock_guard<std::mutex> collector_lock {collector_mutex};
+			if (collector_running) {
+				Timers frames = thread.drain_finished();
+				if (!frames.empty()) {
+					exited_batches.push_back(ThreadBatch{thread.get_id(), thread.get_name(), std::move(frames)});
+				}
+			}
+		}
+
+		/*
+		 * Measures the cost of timing a frame, for Timer::get_corrected_wall and friends.
+		 *
+		 * This runs only in the constructor, while every setting is at its default
+		 * (no flush triggers, an unbounded buffer, and the default callback),
+		 * and before any other thread can read the overheads.
+		 * It times a parent frame around many empty children, on a private Thread.
+		 * Each empty child measures its own "inside" overhead;
+		 * the rest of the parent's time per child is the "outside" overhead.
+		 */
+		void calibrate_overhead() {
+			static constexpr size_t ROUNDS = 4;
+			static constexpr size_t CHILDREN = 256;
+			Thread thread {*this, std::this_thread::get_id(), static_cast<std::thread::native_handle_type>(get_tid()), std::string{"calibration"}, false};
+			bool first = true;
+			for (size_t round = 0; round < ROUNDS; ++round) {
+				thread.enter_stack_frame(0, TypeEraser{type_eraser_default}, false);
+				for (size_t child = 0; child < CHILDREN; ++child) {
+					thread.enter_stack_frame(0, TypeEraser{type_eraser_default}, false);
+					thread.exit_stack_frame();
+				}
+				thread.exit_stack_frame();
+				Timers frames = thread.drain_finished();
+				const Timer& parent = frames.back();
+
+				// Take the minimum over rounds, since noise only ever adds time.
+				WallStamp wall_inside = parent.get_children_wall_stamps() / CHILDREN;
+				WallStamp wall_per_child = parent.get_wall_stamps() / CHILDREN;
+				WallStamp wall_outside = wall_per_child > wall_inside ? wall_per_child - wall_inside : 0;
+				CpuTime cpu_inside = parent.get_children_cpu() / static_cast<int64_t>(CHILDREN);
+				CpuTime cpu_outside = saturating_sub(parent.get_cpu_duration() / static_cast<int64_t>(CHILDREN), cpu_inside);
+				if (first || wall_inside + wall_outside < overhead_wall_inside + overhead_wall_outside) {
+					overhead_wall_inside = wall_inside;
+					overhead_wall_outside = wall_outside;
+				}
+				if (first || cpu_inside + cpu_outside < overhead_cpu_inside + overhead_cpu_outside) {
+					overhead_cpu_inside = cpu_inside;
+					overhead_cpu_outside = cpu_outside;
+				}
+				first = false;
+			}
+		}
 
 	public:
 
 		explicit Process()
-			: start{wall_now()}
+			: wall_clock{get_shared_wall_clock()}
+			, callsites{get_shared_callsites()}
 			, callback{new CallbackType}
-		{ }
+			, collector_callback{new CollectorCallbackType}
+		{
+			calibrate_overhead();
+		}
 
-		WallTime get_start() { return start; }
+		WallTime get_start() { return wall_clock.get_start(); }
+
+		/**
+		 * @brief The clock which stamps every Timer in this process.
+		 *
+		 * Every Process shares one (see get_shared_wall_clock), so that stamps from every thread are comparable,
+		 * and so that Timers convert their stamps with it, whichever Process recorded them.
+		 */
+		const WallClock& get_wall_clock() const { return wall_clock; }
+
+		/**
+		 * @brief The names and SourceLocs which Timers refer to by CallSiteId.
+		 *
+		 * Every Process shares one (see get_shared_callsites), so enabling a CallSite enables it in all of them.
+		 */
+		CallSiteTable& get_callsites() { return callsites; }
+		const CallSiteTable& get_callsites() const { return callsites; }
+
+		/**
+		 * @brief The cost of timing one frame, as measured when this Process was constructed.
+		 */
+		Overhead get_overhead() const {
+			Overhead overhead;
+			if (ClockPolicy::wall) {
+				overhead.wall_inside = wall_clock.to_duration(overhead_wall_inside);
+				overhead.wall_outside = wall_clock.to_duration(overhead_wall_outside);
+			}
+			overhead.cpu_inside = overhead_cpu_inside;
+			overhead.cpu_outside = overhead_cpu_outside;
+			return overhead;
+		}
 
 		/**
 		 * @brief Create or get the thread.
@@ -54,18 +250,9 @@ namespace charmonium::scope_timer::detail {
 				std::thread::native_handle_type native_handle,
 				std::string&& thread_name
 		) {
-			std::lock_guard<std::recursive_mutex> threads_lock {threads_mutex};
 			// This could be the same thread, just a different static context (i.e. different obj-file or lib)
 			// Could have also been set up by the caller.
-			if (threads.count(thread) == 0) {
-				threads.emplace(
-					std::piecewise_construct,
-					std::forward_as_tuple(thread),
-					std::forward_as_tuple(*this, thread, native_handle, std::move(thread_name))
-				);
-			}
-			thread_use_count[thread]++;
-			return threads.at(thread);
+			return threads.acquire(thread, *this, thread, native_handle, std::move(thread_name));
 		}
 
 		/**
@@ -75,14 +262,8 @@ namespace charmonium::scope_timer::detail {
 		 */
 		void delete_thread(std::thread::id thread) {
 			// std::cerr << "Process::delete_thread: " << thread << std::endl;
-			std::lock_guard<std::recursive_mutex> threads_lock {threads_mutex};
 			// This could be the same thread, just a different static context (i.e. different obj-file or lib)
-			if (threads.count(thread) != 0) {
-				thread_use_count[thread]--;
-				if (thread_use_count.at(thread) == 0) {
-					threads.erase(thread);
-				}
-			}
+			threads.release(thread);
 		}
 
 		/**
@@ -95,13 +276,51 @@ namespace charmonium::scope_timer::detail {
 		}
 
 		/**
-		 * @brief Sets @p callback_period for future threads.
+		 * @brief Calls callback when a thread has used @p callback_period of CPU time since its last call.
 		 *
-		 * All in-progress threads will complete with the prior value.
+		 * This takes effect immediately for all threads; 0 disables this trigger.
+		 * A thread which mostly sleeps may rarely reach this; see set_callback_wall_period.
 		 */
-		void set_callback_period(CpuTime callback_period_) {
-			// std::lock_guard<std::recursive_mutex> config_lock {config_mutex};
-			callback_period = callback_period_;
+		void set_callback_period(CpuTime callback_period_) { flush_cpu_period.store(callback_period_, std::memory_order_relaxed); }
+
+		/**
+		 * @brief Calls callback when a frame finishes @p wall_period after the thread's last call.
+		 *
+		 * This is checked against the frames' own stamps, so it costs no extra clock reads,
+		 * but it is never reached if ClockPolicy does not read the wall clock.
+		 * This takes effect immediately for all threads.
+		 * A nonzero period is converted to WallClock stamps here, which may calibrate the clock (see WallClock::calibration_ns).
+		 */
+		void set_callback_wall_period(WallTime wall_period) {
+			flush_wall_period.store(wall_period, std::memory_order_relaxed);
+			flush_wall_stamps.store(get_ns(wall_period) == 0 ? 0 : std::max(wall_clock.to_stamps(wall_period), WallStamp{1}), std::memory_order_relaxed);
+		}
+
+		/**
+		 * @brief Calls callback when a thread has buffered @p records finished frames.
+		 *
+		 * This takes effect immediately for all threads.
+		 */
+		void set_callback_records(size_t records) { flush_records.store(records, std::memory_order_relaxed); }
+
+		/**
+		 * @brief Calls callback when a thread has buffered @p bytes of finished frames.
+		 *
+		 * Info payloads too large to be stored inline are not counted.
+		 * This takes effect immediately for all threads.
+		 */
+		void set_callback_bytes(size_t bytes) { flush_bytes.store(bytes, std::memory_order_relaxed); }
+
+		/**
+		 * @brief A snapshot of the flush triggers.
+		 */
+		FlushTriggers get_flush_triggers() const {
+			FlushTriggers triggers;
+			triggers.cpu_period = flush_cpu_period.load(std::memory_order_relaxed);
+			triggers.wall_period = flush_wall_period.load(std::memory_order_relaxed);
+			triggers.records = flush_records.load(std::memory_order_relaxed);
+			triggers.bytes = flush_bytes.load(std::memory_order_relaxed);
+			return triggers;
 		}
 
 		/**
@@ -116,13 +335,185 @@ namespace charmonium::scope_timer::detail {
 		 *
 		 * This is the most efficient, putting the entire lifetime of
 		 * each thread into one batch and calling the callback.
+		 * This disables every trigger.
+		 */
+		void callback_once() {
+			set_callback_period(CpuTime{0});
+			set_callback_wall_period(WallTime{0});
+			set_callback_records(0);
+			set_callback_bytes(0);
+		}
+
+		/**
+		 * @brief Sets the most finished frames each Thread buffers (0 for unbounded).
+		 *
+		 * When a Thread's buffer is full, it applies the OverflowPolicy (see set_overflow_policy).
+		 * This takes effect immediately for all threads.
+		 */
+		void set_buffer_capacity(size_t records) { buffer_capacity.store(records, std::memory_order_relaxed); }
+
+		/**
+		 * @brief Like set_buffer_capacity, but in bytes of Timer records.
+		 *
+		 * Info payloads too large to be stored inline are not counted.
 		 */
-		void callback_once() { set_callback_period(CpuTime{0}); }
+		void set_buffer_capacity_bytes(size_t bytes) { set_buffer_capacity(std::max(bytes / sizeof(Timer), size_t{1})); }
+
+		size_t get_buffer_capacity() const { return buffer_capacity.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief Sets what a Thread does when its buffer is full.
+		 *
+		 * This takes effect immediately for all threads.
+		 * OverflowPolicy::block waits for a consumer (e.g. the collector; see start_collector), so start one first.
+		 */
+		void set_overflow_policy(OverflowPolicy overflow_policy_) { overflow_policy.store(overflow_policy_, std::memory_order_relaxed); }
+
+		OverflowPolicy get_overflow_policy() const { return overflow_policy.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief Sets future threads to sample their open frames every @p period of CPU time, instead of timing every frame (0 to time every frame).
+		 *
+		 * A sampling thread records no Timers; entering and exiting a frame only pushes and pops its CallSite, reading no clocks.
+		 * Instead, a CPU-time timer signals the thread (with CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL, default SIGPROF),
+		 * and the handler counts a sample against the calling context of the open frames (see Thread::get_sample_tree).
+		 * This installs a handler for that signal, replacing any other.
+		 * All in-progress threads will complete with the prior value.
+		 */
+		void set_sampling_period(CpuTime period) {
+			if (get_ns(period) != 0) {
+				static std::once_flag installed;
+				std::call_once(installed, [] {
+					struct sigaction action {};
+					action.sa_handler = &Thread::on_sample_signal;
+					action.sa_flags = SA_RESTART;
+					sigemptyset(&action.sa_mask);
+					sigaction(CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL, &action, nullptr);
+				});
+			}
+			sampling_period = period;
+		}
+
+		CpuTime get_sampling_period() const { return sampling_period; }
+
+		/**
+		 * @brief Limits each CallSite to recording about @p frames_per_cpu_second frames per second of each thread's CPU time (0 for no limit).
+		 *
+		 * A CallSite over the limit records only 1 in K of its calls, with K adjusted as its rate changes (see RateLimiter).
+		 * If ClockPolicy does not read the CPU clock, the limit is per second of wall time instead.
+		 * Skipped calls cost a counter, not a Timer; the frames inside them are recorded as children of the nearest recorded caller.
+		 * Exact call counts and extrapolated times are in Thread::get_callsite_rates.
+		 * This takes effect immediately for all threads.
+		 */
+		void set_rate_limit(size_t frames_per_cpu_second) { rate_limit.store(frames_per_cpu_second, std::memory_order_relaxed); }
+
+		size_t get_rate_limit() const { return rate_limit.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief Sets future threads to count their frames' wall and CPU durations in per-CallSite histograms.
+		 *
+		 * This is independent of the other modes: frames are still recorded (or aggregated) as usual.
+		 * Recording a frame costs a few loads and stores, without locks; each CallSite a thread uses costs it a few KB.
+		 * Read the histograms with read_latencies.
+		 * All in-progress threads will complete with the prior value.
+		 */
+		void set_latency_histograms(bool latency_histograms_) { latency_histograms = latency_histograms_; }
+
+		bool is_recording_latencies() const { return latency_histograms; }
+
+		/**
+		 * @brief Merges the latency histograms of every thread, live or exited, since it started.
+		 *
+		 * Counts only grow, so the histograms of a window are a later reading minus an earlier one (see Latencies::subtract).
+		 * This takes no lock.
+		 */
+		Latencies read_latencies() const {
+			Latencies latencies;
+			latency_recorders.read(latencies);
+			return latencies;
+		}
+
+		/**
+		 * @brief Sets future threads to sketch their frames' wall and CPU durations by CallSite and by @p key (nullptr to stop).
+		 *
+		 * @p key is called on each finished frame, in its thread, and should extract a key from the frame's info
+		 * (e.g. an enum, or a hash of the input's name; see TypeEraser::holds).
+		 * It is a plain function (or a lambda without captures), so that calling it costs no more than an indirect call.
+		 * Each (CallSite, key) gets QuantileSketches, whose quantiles are within 1% relative error.
+		 * Each thread holds at most @p max_keys of them; past that, the rarest keys are merged into their CallSite's SketchTable::other_key.
+		 * Each thread sketches without locking, and publishes its sketches when it flushes (see set_callback_period and friends) and when it exits.
+		 * Collect the published sketches with drain_sketches.
+		 * All in-progress threads will complete with the prior value.
+		 */
+		void set_sketch_key(SketchKey key, size_t max_keys = 1024) {
+			std::lock_guard<std::mutex> sketches_lock {sketches_mutex};
+			sketch_key = key;
+			sketch_max_keys = max_keys;
+			exited_sketches.set_max_keys(max_keys);
+		}
+
+		/**
+		 * @brief Merges the sketches of every sketching thread, live or exited, and clears them.
+		 *
+		 * A live thread's sketches are as of its last flush (see Thread::drain_sketches).
+		 */
+		SketchTable drain_sketches() {
+			SketchTable sketches;
+			{
+				std::lock_guard<std::mutex> sketches_lock {sketches_mutex};
+				sketches.set_max_keys(sketch_max_keys);
+				sketches.merge(exited_sketches);
+				exited_sketches.clear();
+			}
+			threads.for_each([&](Thread& thread) { thread.drain_sketches(sketches); });
+			return sketches;
+		}
+
+		/**
+		 * @brief Sets future threads to aggregate their frames into a calling-context tree, instead of keeping each frame.
+		 *
+		 * An aggregating thread's memory grows with its distinct call paths, not its frames, and it never calls thread_in_situ with frames.
+		 * Frames are still timed as usual; each finishes into its path's CallTreeNode (count, inclusive and exclusive time, min and max),
+		 * in a tree only that thread touches, so this takes no lock per frame.
+		 * The thread publishes its tree when it flushes (see set_callback_period and friends) and when it exits.
+		 * Collect the published trees with drain_call_tree.
+		 * All in-progress threads will complete with the prior value.
+		 */
+		void set_aggregating(bool aggregating_) { aggregating = aggregating_; }
+
+		bool is_aggregating() const { return aggregating; }
+
+		/**
+		 * @brief Merges the CallTrees of every aggregating thread, live or exited, and zeroes them.
+		 *
+		 * A live thread's tree is as of its last flush (see Thread::drain_call_tree); frames still open are not included.
+		 */
+		CallTree drain_call_tree() {
+			CallTree tree;
+			{
+				std::lock_guard<std::mutex> call_tree_lock {call_tree_mutex};
+				std::swap(tree, exited_call_tree);
+			}
+			threads.for_each([&](Thread& thread) { thread.drain_call_tree(tree); });
+			return tree;
+		}
 
 		bool is_enabled() const {
 			return enabled;
 		}
 
+		/**
+		 * @brief Sets which hardware counters future threads open, and in what order Timer::get_counter reports them.
+		 *
+		 * Only the first CHARMONIUM_SCOPE_TIMER_MAX_COUNTERS are used.
+		 * All in-progress threads will complete with the prior value.
+		 */
+		void set_hardware_counters(std::vector<HardwareCounter>&& hardware_counters_) {
+			hardware_counters = std::move(hardware_counters_);
+		}
+
+		const std::vector<HardwareCounter>& get_hardware_counters() const { return hardware_counters; }
+
 		/**
 		 * @brief Sets @p callback for future threads.
 		 *
@@ -148,6 +539,92 @@ namespace charmonium::scope_timer::detail {
 		}
 
 
+		/**
+		 * @brief Starts a thread which drains every Thread each @p period and passes the batches to the collector callback.
+		 *
+		 * Instrumented threads then pay only for recording, and frames are delivered even from threads which are blocked or idle.
+		 * Frames of threads which exit between rounds are delivered in the next round.
+		 * The per-thread callback (see set_callback) is still called; use callback_once() and the default CallbackType to leave draining to the collector.
+		 */
+		void start_collector(WallTime period) {
+			stop_collector();
+			{
+				std::lock_guard<std::mutex> collector_lock {collector_mutex};
+				collector_period = period;
+				collector_running = true;
+			}
+			collector = std::thread{[this] { run_collector(); }};
+		}
+
+		/**
+		 * @brief Stops the collector thread, after one last round.
+		 */
+		void stop_collector() {
+			{
+				std::lock_guard<std::mutex> collector_lock {collector_mutex};
+				if (!collector_running) {
+					return;
+				}
+				collector_running = false;
+			}
+			collector_wakeup.notify_all();
+			collector.join();
+		}
+
+		/**
+		 * @brief Runs one round of collection now, in this thread.
+		 */
+		void collect() {
+			std::lock_guard<std::mutex> collect_lock {collect_mutex};
+			std::vector<ThreadBatch> batches;
+			{
+				std::lock_guard<std::mutex> collector_lock {collector_mutex};
+				batches.swap(exited_batches);
+			}
+			threads.for_each([&](Thread& thread) {
+				Timers frames = thread.drain_finished();
+				if (!frames.empty()) {
+					batches.push_back(ThreadBatch{thread.get_id(), thread.get_name(), std::move(frames)});
+				}
+			});
+			if (!batches.empty()) {
+				collector_callback->collect(std::move(batches));
+			}
+		}
+
+		/**
+		 * @brief Reads what every thread is in the middle of, without stopping them.
+		 *
+		 * Threads only publish their open frames if CHARMONIUM_SCOPE_TIMER_LIVE_STACK is 1 (or they sample; see set_sampling_period);
+		 * otherwise each sample lists the thread with a depth of 0.
+		 * This may be called from any thread (e.g. a watchdog), and takes no lock.
+		 */
+		std::vector<ThreadSample> sample_stacks() const {
+			std::vector<ThreadSample> samples;
+			threads.for_each([&](const Thread& thread) {
+				samples.push_back(ThreadSample{thread.get_id(), WallTime{0}, std::vector<LiveFrame>{}, 0});
+				ThreadSample& sample = samples.back();
+				sample.sampled_wall = wall_clock.since_start(wall_clock.stamp_start());
+				sample.depth = thread.get_live_stack().read(sample.frames);
+			});
+			return samples;
+		}
+
+		/**
+		 * @brief Sets the callback which receives the collector's batches.
+		 *
+		 * Call this before start_collector.
+		 */
+		template <typename YourCollectorCallbackType>
+		void set_collector_callback(std::unique_ptr<YourCollectorCallbackType>&& collector_callback_) {
+			collector_callback = std::unique_ptr<CollectorCallbackType>{static_cast<CollectorCallbackType*>(collector_callback_.release())};
+		}
+
+		template <typename YourCollectorCallbackType>
+		YourCollectorCallbackType& get_collector_callback() {
+			return dynamic_cast<YourCollectorCallbackType&>(*collector_callback);
+		}
+
 		// get_thread() returns pointers into this, so it should not be copied or moved.
 		Process(const Process&) = delete;
 		Process& operator=(const Process&) = delete;
@@ -155,17 +632,55 @@ namespace charmonium::scope_timer::detail {
 		Process& operator=(const Process&&) = delete;
 		~Process() {
 			// std::cout << "Process::~Process" << std::endl;
-			for (const auto& pair : threads) {
-				std::cerr << pair.first << " is still around. Going to kick their logs out.\n";
-			}
+			stop_collector();
+			threads.for_each([](const Thread& thread) {
+				std::cerr << thread.get_id() << " is still around. Going to kick their logs out.\n";
+			});
 		}
 	};
 
 	inline CallbackType& Thread::get_callback() const { return *process.callback; }
 
-	inline CpuTime Thread::get_callback_period() const { return process.callback_period; }
+	inline FlushTriggers Thread::get_flush_triggers() const { return process.get_flush_triggers(); }
+
+	inline WallStamp Thread::get_flush_wall_stamps() const { return process.flush_wall_stamps.load(std::memory_order_relaxed); }
+
+	inline CpuTime Thread::get_sampling_period() const { return process.sampling_period; }
+
+	inline size_t Thread::get_rate_limit() const { return process.get_rate_limit(); }
+
+	inline bool Thread::get_latency_histograms() const { return process.latency_histograms; }
+
+	inline LatencyRecorder* Thread::lend_latency_recorder() { return process.latency_recorders.lend(); }
+
+	inline void Thread::give_back_latency_recorder() { process.latency_recorders.give_back(latencies); }
+
+	inline Thread::Sketching* Thread::make_sketching() const {
+		std::lock_guard<std::mutex> sketches_lock {process.sketches_mutex};
+		return process.sketch_key != nullptr ? new Sketching{process.sketch_key, SketchTable{process.sketch_max_keys}, {}, SketchTable{process.sketch_max_keys}} : nullptr;
+	}
+
+	inline void Thread::hand_off_sketches() {
+		std::lock_guard<std::mutex> sketches_lock {process.sketches_mutex};
+		drain_sketches(process.exited_sketches);
+	}
+
+	inline bool Thread::get_aggregating() const { return process.aggregating; }
+
+	inline void Thread::hand_off_call_tree() {
+		std::lock_guard<std::mutex> call_tree_lock {process.call_tree_mutex};
+		drain_call_tree(process.exited_call_tree);
+	}
+
+	inline void Thread::hand_off_to_collector() { process.hand_off_to_collector(*this); }
+
+	inline size_t Thread::get_buffer_capacity() const { return process.get_buffer_capacity(); }
+
+	inline OverflowPolicy Thread::get_overflow_policy() const { return process.get_overflow_policy(); }
+
+	inline const WallClock& Thread::get_wall_clock() const { return process.wall_clock; }
 
-	inline WallTime Thread::get_process_start() const { return process.start; }
+	inline const std::vector<HardwareCounter>& Thread::get_hardware_counter_config() const { return process.hardware_counters; }
 
 	// TODO(grayson5): Figure out which threads the callback could be called from.
 	// thread_in_situ will always be called from the target thread.
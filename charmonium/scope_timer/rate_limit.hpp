@@ -0,0 +1,150 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief One thread's calls of one CallSite, when rate limiting (see Process::set_rate_limit).
+	 */
+	class CallSiteRate {
+	private:
+		friend class RateLimiter;
+
+		uint64_t calls {0};
+		uint64_t recorded {0};
+		CpuTime recorded_cpu {0};
+		WallStamp recorded_wall {0};
+		uint32_t sample_every {1};
+		uint32_t countdown {1};
+		// The current window, over which the rate is measured, in RateLimiter ticks.
+		uint64_t window_start {0};
+		uint64_t window_calls {0};
+
+	public:
+		/**
+		 * @brief Every call, recorded or not.
+		 */
+		uint64_t get_calls() const { return calls; }
+
+		/**
+		 * @brief The calls which were recorded as Timers and have finished.
+		 */
+		uint64_t get_recorded() const { return recorded; }
+
+		/**
+		 * @brief Currently, 1 in this many calls is recorded.
+		 */
+		uint32_t get_sample_every() const { return sample_every; }
+
+		/**
+		 * @brief The CPU time of every call, extrapolated from the recorded calls.
+		 */
+		CpuTime get_estimated_cpu() const {
+			return recorded == 0 ? CpuTime{0} : CpuTime{static_cast<int64_t>(static_cast<double>(get_ns(recorded_cpu)) * calls / recorded)};
+		}
+
+		/**
+		 * @brief The wall time of every call, extrapolated from the recorded calls.
+		 */
+		WallTime get_estimated_wall() const {
+			return recorded == 0 ? WallTime{0} : get_shared_wall_clock().to_duration(static_cast<WallStamp>(static_cast<double>(recorded_wall) * calls / recorded));
+		}
+	};
+
+	/**
+	 * @brief Decides which calls of each CallSite a Thread records.
+	 *
+	 * Each CallSite records 1 in K of its calls, counting down, so the choice is cheap and deterministic.
+	 * Each time a CallSite has recorded frames for window of CPU time,
+	 * K is recomputed so that it records about `limit` frames per second of CPU time.
+	 * Rates are measured from the recorded frames' own stamps, so this reads no extra clocks.
+	 * If ClockPolicy does not read the CPU clock, windows and rates are measured in wall time instead
+	 * (and if it reads neither, this does nothing).
+	 * Only the owning thread may use this.
+	 */
+	class RateLimiter {
+	public:
+		static constexpr int64_t window_ns = 10 * 1000 * 1000;
+
+	private:
+		// Ticks are CPU nanoseconds, or WallClock stamps when ClockPolicy does not read the CPU clock.
+		static constexpr bool use_wall = !ClockPolicy::cpu;
+		static constexpr bool use_clock = ClockPolicy::cpu || ClockPolicy::wall;
+
+		std::vector<CallSiteRate> rates;
+		// window_ns in ticks, converted at the first window.
+		uint64_t window_ticks {0};
+
+		static uint64_t start_ticks(const Timer& timer) { return use_wall ? timer.get_wall_stamp(true) : static_cast<uint64_t>(get_ns(timer.get_start_cpu())); }
+		static uint64_t stop_ticks(const Timer& timer) { return use_wall ? timer.get_wall_stamp(false) : static_cast<uint64_t>(get_ns(timer.get_stop_cpu())); }
+		static double to_seconds(uint64_t ticks) {
+			return static_cast<double>(use_wall ? get_ns(get_shared_wall_clock().to_duration(ticks)) : ticks) / 1e9;
+		}
+
+	public:
+		/**
+		 * @brief Counts a call of @p callsite and returns whether to record it.
+		 */
+		bool should_record(CallSiteId callsite) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(callsite >= rates.size())) {
+				rates.resize(callsite + 1);
+			}
+			CallSiteRate& rate = rates[callsite];
+			++rate.calls;
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(--rate.countdown != 0)) {
+				return false;
+			}
+			rate.countdown = rate.sample_every;
+			return true;
+		}
+
+		/**
+		 * @brief Accounts for a recorded frame which just finished, and adjusts its CallSite's K.
+		 */
+		void on_recorded(const Timer& timer, size_t limit) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(timer.get_callsite_id() >= rates.size())) {
+				// This started before rate limiting was turned on.
+				return;
+			}
+			CallSiteRate& rate = rates[timer.get_callsite_id()];
+			++rate.recorded;
+			rate.recorded_cpu += timer.get_cpu_duration();
+			rate.recorded_wall += timer.get_wall_stamps();
+			if (!use_clock) {
+				return;
+			}
+			uint64_t now = stop_ticks(timer);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(rate.recorded == 1)) {
+				rate.window_start = start_ticks(timer);
+				rate.window_calls = rate.calls - 1;
+			}
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(window_ticks == 0)) {
+				window_ticks = use_wall ? get_shared_wall_clock().to_stamps(WallTime{window_ns}) : static_cast<uint64_t>(window_ns);
+			}
+			uint64_t elapsed = now - rate.window_start;
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(elapsed >= window_ticks)) {
+				double allowed = static_cast<double>(limit) * to_seconds(elapsed);
+				double sample_every = std::ceil(static_cast<double>(rate.calls - rate.window_calls) / allowed);
+				rate.sample_every = static_cast<uint32_t>(std::min(
+					std::max(sample_every, 1.0),
+					static_cast<double>(std::numeric_limits<uint32_t>::max())
+				));
+				rate.countdown = std::min(rate.countdown, rate.sample_every);
+				rate.window_start = now;
+				rate.window_calls = rate.calls;
+			}
+		}
+
+		/**
+		 * @brief The rates, indexed by CallSiteId; CallSites this thread never called may be missing.
+		 */
+		const std::vector<CallSiteRate>& get_rates() const { return rates; }
+	};
+
+} // namespace charmonium::scope_timer::detail
@@ -0,0 +1,187 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "live_stack.hpp"
+#include "os_specific.hpp"
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+#ifndef CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL
+#define CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL SIGPROF
+#endif
+
+#ifndef CHARMONIUM_SCOPE_TIMER_SAMPLE_NODES
+#define CHARMONIUM_SCOPE_TIMER_SAMPLE_NODES 4096
+#endif
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief One calling context in a SampleTree, as read by SampleTree::read.
+	 */
+	struct SampleNode {
+		CallSiteId callsite;
+		/// The index of the caller's node; the root (index 0, the thread's root frame) is its own parent.
+		uint32_t parent;
+		/// Samples taken while this was the innermost open frame.
+		uint64_t samples;
+	};
+
+	/**
+	 * @brief Counts samples per calling context (path of CallSites from the thread's root frame).
+	 *
+	 * Only the owning thread's signal handler writes, into preallocated nodes, so recording is async-signal-safe.
+	 * Any thread may read.
+	 * When the nodes run out, samples go to the deepest calling context which already has a node.
+	 */
+	class SampleTree {
+	public:
+		static constexpr uint32_t max_nodes = CHARMONIUM_SCOPE_TIMER_SAMPLE_NODES;
+
+	private:
+		static constexpr uint32_t none = 0;
+
+		struct Node {
+			// These are written before the node is published by size.
+			CallSiteId callsite {0};
+			uint32_t parent {0};
+			// Only the signal handler uses these.
+			uint32_t first_child {none};
+			uint32_t next_sibling {none};
+			std::atomic<uint64_t> samples {0};
+		};
+
+		std::unique_ptr<Node[]> nodes;
+		std::atomic<uint32_t> size;
+		std::atomic<uint64_t> truncated;
+
+		uint32_t find_or_add_child(uint32_t parent, CallSiteId callsite) {
+			for (uint32_t child = nodes[parent].first_child; child != none; child = nodes[child].next_sibling) {
+				if (nodes[child].callsite == callsite) {
+					return child;
+				}
+			}
+			uint32_t size_ = size.load(std::memory_order_relaxed);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(size_ == max_nodes)) {
+				return none;
+			}
+			Node& node = nodes[size_];
+			node.callsite = callsite;
+			node.parent = parent;
+			node.next_sibling = nodes[parent].first_child;
+			nodes[parent].first_child = size_;
+			size.store(size_ + 1, std::memory_order_release);
+			return size_;
+		}
+
+	public:
+		SampleTree()
+			: nodes{new Node[max_nodes]}
+			, size{1}
+			, truncated{0}
+		{ }
+
+		/**
+		 * @brief Counts one sample against the open frames in @p live_stack.
+		 *
+		 * Only the owning thread (i.e. its signal handler) may call this.
+		 * If the handler interrupted a push, that frame is not yet counted in the depth, so the earlier frames are consistent.
+		 */
+		void record(const LiveStack& live_stack) {
+			size_t depth = live_stack.get_depth();
+			size_t published = depth < LiveStack::max_depth ? depth : LiveStack::max_depth;
+			uint32_t node = 0;
+			for (size_t i = 1; i < published; ++i) {
+				uint32_t child = find_or_add_child(node, live_stack.get_callsite(i));
+				if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(child == none)) {
+					truncated.fetch_add(1, std::memory_order_relaxed);
+					break;
+				}
+				node = child;
+			}
+			nodes[node].samples.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/**
+		 * @brief Every calling context sampled so far; callers precede callees.
+		 *
+		 * This may be called from any thread.
+		 */
+		std::vector<SampleNode> read() const {
+			uint32_t size_ = size.load(std::memory_order_acquire);
+			std::vector<SampleNode> result;
+			result.reserve(size_);
+			for (uint32_t i = 0; i < size_; ++i) {
+				result.push_back(SampleNode{nodes[i].callsite, nodes[i].parent, nodes[i].samples.load(std::memory_order_relaxed)});
+			}
+			return result;
+		}
+
+		/**
+		 * @brief The number of samples attributed to a caller because there were no nodes left.
+		 */
+		uint64_t get_num_truncated() const { return truncated.load(std::memory_order_relaxed); }
+	};
+
+	/**
+	 * @brief Sends CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL to the calling thread every @p period of its CPU time.
+	 */
+	class SampleTimer {
+	private:
+		timer_t timer_id {};
+		bool armed {false};
+
+	public:
+		SampleTimer() = default;
+
+		explicit SampleTimer(CpuTime period) {
+			struct sigevent event {};
+			event.sigev_notify = SIGEV_THREAD_ID;
+			event.sigev_signo = CHARMONIUM_SCOPE_TIMER_SAMPLE_SIGNAL;
+			event.sigev_notify_thread_id = static_cast<pid_t>(get_tid());
+			if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_id) != 0) {
+				return;
+			}
+			struct itimerspec spec {};
+			spec.it_interval.tv_sec = static_cast<time_t>(get_ns(period) / 1000000000);
+			spec.it_interval.tv_nsec = static_cast<long>(get_ns(period) % 1000000000);
+			spec.it_value = spec.it_interval;
+			if (timer_settime(timer_id, 0, &spec, nullptr) != 0) {
+				timer_delete(timer_id);
+				return;
+			}
+			armed = true;
+		}
+
+		SampleTimer(const SampleTimer&) = delete;
+		SampleTimer& operator=(const SampleTimer&) = delete;
+		SampleTimer& operator=(SampleTimer&&) = delete;
+
+		SampleTimer(SampleTimer&& other) noexcept
+			: timer_id{other.timer_id}
+			, armed{other.armed}
+		{
+			other.armed = false;
+		}
+
+		~SampleTimer() { disarm(); }
+
+		void disarm() {
+			if (armed) {
+				timer_delete(timer_id);
+				armed = false;
+			}
+		}
+
+		bool is_armed() const { return armed; }
+	};
+
+} // namespace charmonium::scope_timer::detail
@@ -1,5 +1,6 @@
 #pragma once // NOLINT(llvm-header-guard)
 
+#include "callsite.hpp"
 #include "process.hpp"
 #include "source_loc.hpp"
 #include "thread.hpp"
@@ -14,29 +15,31 @@ namespace charmonium::scope_timer::detail {
 		Process* process;
 		Thread* thread;
 		SourceLoc source_loc;
+		// Set by SCOPE_TIMER; if null, each ScopeTimer interns its CallSite anew.
+		CallSiteCache* callsite_cache;
 
 		ScopeTimerArgs set_info(TypeEraser&& new_info) && {
-			return ScopeTimerArgs{std::move(new_info), name, only_time_start, process, thread, std::move(source_loc)};
+			return ScopeTimerArgs{std::move(new_info), name, only_time_start, process, thread, std::move(source_loc), callsite_cache};
 		}
 
 		ScopeTimerArgs set_name(const char* new_name) && {
-			return ScopeTimerArgs{std::move(info), new_name, only_time_start, process, thread, std::move(source_loc)};
+			return ScopeTimerArgs{std::move(info), new_name, only_time_start, process, thread, std::move(source_loc), callsite_cache};
 		}
 
 		ScopeTimerArgs set_process(Process* new_process) {
-			return ScopeTimerArgs{std::move(info), name, only_time_start, new_process, thread, std::move(source_loc)};
+			return ScopeTimerArgs{std::move(info), name, only_time_start, new_process, thread, std::move(source_loc), callsite_cache};
 		}
 
 		ScopeTimerArgs set_thread(Thread* new_thread) {
-			return ScopeTimerArgs{std::move(info), name, only_time_start, process, new_thread, std::move(source_loc)};
+			return ScopeTimerArgs{std::move(info), name, only_time_start, process, new_thread, std::move(source_loc), callsite_cache};
 		}
 
 		ScopeTimerArgs set_source_loc(SourceLoc&& new_source_loc) {
-			return ScopeTimerArgs{std::move(info), name, only_time_start, process, thread, std::move(new_source_loc)};
+			return ScopeTimerArgs{std::move(info), name, only_time_start, process, thread, std::move(new_source_loc), callsite_cache};
 		}
 
 		ScopeTimerArgs set_only_time_start(bool new_only_time_start) {
-			return ScopeTimerArgs{std::move(info), name, new_only_time_start, process, thread, std::move(source_loc)};
+			return ScopeTimerArgs{std::move(info), name, new_only_time_start, process, thread, std::move(source_loc), callsite_cache};
 		}
 	};
 
@@ -56,7 +59,11 @@ namespace charmonium::scope_timer::detail {
 			, enabled{args.process->is_enabled()}
 		{
 			if (CHARMONIUM_SCOPE_TIMER_LIKELY(enabled)) {
-				args.thread->enter_stack_frame(args.name, std::move(args.info), std::move(args.source_loc), args.only_time_start);
+				CallSiteTable& callsites = args.process->get_callsites();
+				const CallSite& callsite = CHARMONIUM_SCOPE_TIMER_LIKELY(args.callsite_cache != nullptr)
+					? args.callsite_cache->get(callsites, args.name, args.source_loc)
+					: callsites.intern(args.name, args.source_loc);
+				enabled = callsite.is_enabled() && args.thread->enter_stack_frame(callsite.id, std::move(args.info), args.only_time_start);
 			}
 		}
 
@@ -0,0 +1,305 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#ifndef CHARMONIUM_SCOPE_TIMER_SKETCH_BINS
+#define CHARMONIUM_SCOPE_TIMER_SKETCH_BINS 2048
+#endif
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief A mergeable quantile sketch with relative error (DDSketch-style).
+	 *
+	 * Value v is counted in bin ceil(log_gamma(v)), where gamma = (1 + relative_accuracy) / (1 - relative_accuracy),
+	 * so every quantile is within relative_accuracy of a true value.
+	 * Bins span only the range of values seen, up to max_bins of them;
+	 * beyond that, the lowest bins are collapsed together, losing accuracy only in the lowest quantiles.
+	 */
+	class QuantileSketch {
+	public:
+		static constexpr double relative_accuracy = 0.01;
+		static constexpr size_t max_bins = CHARMONIUM_SCOPE_TIMER_SKETCH_BINS;
+
+	private:
+		// bins[i] counts bin number offset + i.
+		std::vector<uint64_t> bins;
+		int32_t offset {0};
+		uint64_t zero_count {0};
+		uint64_t count {0};
+
+		static double gamma() { return (1 + relative_accuracy) / (1 - relative_accuracy); }
+
+		static int32_t bin_of(uint64_t value) {
+			static const double log_gamma = std::log(gamma());
+			return static_cast<int32_t>(std::ceil(std::log(static_cast<double>(value)) / log_gamma));
+		}
+
+		/*
+		 * Grows the bins to cover [lo, hi], collapsing the lowest if there would be too many.
+		 */
+		void cover(int32_t lo, int32_t hi) {
+			if (!bins.empty()) {
+				int32_t top = offset + static_cast<int32_t>(bins.size()) - 1;
+				if (lo >= offset && hi <= top) {
+					return;
+				}
+				lo = std::min(lo, offset);
+				hi = std::max(hi, top);
+			}
+			lo = std::max(lo, hi - static_cast<int32_t>(max_bins) + 1);
+			std::vector<uint64_t> covered (static_cast<size_t>(hi - lo + 1), 0);
+			for (size_t i = 0; i < bins.size(); ++i) {
+				covered[static_cast<size_t>(std::max(offset + static_cast<int32_t>(i), lo) - lo)] += bins[i];
+			}
+			bins.swap(covered);
+			offset = lo;
+		}
+
+		void add_to_bin(int32_t bin, uint64_t times) {
+			bins[static_cast<size_t>(std::max(bin, offset) - offset)] += times;
+		}
+
+	public:
+		void add(uint64_t value, uint64_t times = 1) {
+			count += times;
+			if (value == 0) {
+				zero_count += times;
+				return;
+			}
+			int32_t bin = bin_of(value);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(bins.empty() || bin < offset || bin >= offset + static_cast<int32_t>(bins.size()))) {
+				cover(bin, bin);
+			}
+			add_to_bin(bin, times);
+		}
+
+		void merge(const QuantileSketch& other) {
+			count += other.count;
+			zero_count += other.zero_count;
+			if (other.bins.empty()) {
+				return;
+			}
+			cover(other.offset, other.offset + static_cast<int32_t>(other.bins.size()) - 1);
+			for (size_t i = 0; i < other.bins.size(); ++i) {
+				add_to_bin(other.offset + static_cast<int32_t>(i), other.bins[i]);
+			}
+		}
+
+		uint64_t get_count() const { return count; }
+
+		/**
+		 * @brief The value below which a fraction @p q of the values fall (e.g. 0.99 for p99), or 0 if empty.
+		 */
+		uint64_t get_quantile(double q) const {
+			if (count == 0) {
+				return 0;
+			}
+			auto rank = static_cast<uint64_t>(std::ceil(std::min(std::max(q, 0.0), 1.0) * static_cast<double>(count)));
+			rank = std::max(rank, uint64_t{1});
+			uint64_t seen = zero_count;
+			if (seen >= rank) {
+				return 0;
+			}
+			size_t i = 0;
+			for (; i + 1 < bins.size(); ++i) {
+				seen += bins[i];
+				if (seen >= rank) {
+					break;
+				}
+			}
+			// Bin b holds (gamma^(b-1), gamma^b]; this point is within relative_accuracy of both ends.
+			return static_cast<uint64_t>(std::llround(2 * std::pow(gamma(), offset + static_cast<int32_t>(i)) / (gamma() + 1)));
+		}
+
+		/**
+		 * @brief The memory held by the bins.
+		 */
+		size_t get_bytes() const { return bins.capacity() * sizeof(uint64_t); }
+	};
+
+	/**
+	 * @brief Sketches of the durations of the frames of one CallSite with one key (see Process::set_sketch_key).
+	 */
+	class KeyedLatency {
+	private:
+		friend class SketchTable;
+
+		CallSiteId callsite;
+		uint64_t key;
+		QuantileSketch cpu;
+		// In WallClock stamps.
+		QuantileSketch wall;
+
+		KeyedLatency(CallSiteId callsite_, uint64_t key_)
+			: callsite{callsite_}
+			, key{key_}
+		{ }
+
+	public:
+		CallSiteId get_callsite_id() const { return callsite; }
+
+		/**
+		 * @brief The key extracted from these frames, or SketchTable::other_key for frames whose keys were evicted.
+		 */
+		uint64_t get_key() const { return key; }
+
+		/**
+		 * @brief The number of frames which finished.
+		 */
+		uint64_t get_count() const { return cpu.get_count(); }
+
+		/**
+		 * @brief The CPU time below which a fraction @p q of the frames fall (e.g. 0.99 for p99).
+		 */
+		CpuTime get_cpu_quantile(double q) const { return CpuTime{static_cast<int64_t>(cpu.get_quantile(q))}; }
+
+		/**
+		 * @brief The wall time below which a fraction @p q of the frames fall.
+		 */
+		WallTime get_wall_quantile(double q) const { return get_shared_wall_clock().to_duration(wall.get_quantile(q)); }
+
+		/**
+		 * @brief CPU durations in nanoseconds.
+		 */
+		const QuantileSketch& get_cpu_sketch() const { return cpu; }
+
+		/**
+		 * @brief Wall durations in WallClock stamps (see WallClock::to_duration).
+		 */
+		const QuantileSketch& get_wall_sketch() const { return wall; }
+	};
+
+	/**
+	 * @brief Extracts a sketch key from a finished frame (see Process::set_sketch_key).
+	 *
+	 * This is a plain function pointer, so calling it on every frame costs one indirect call.
+	 */
+	using SketchKey = uint64_t (*)(const Timer&);
+
+	/**
+	 * @brief QuantileSketches keyed by (CallSite, key), holding at most a fixed number of keys.
+	 *
+	 * When the table is full, the half of its entries with the fewest frames are evicted:
+	 * each is merged into the other_key entry of its CallSite, so its frames still count toward the CallSite.
+	 * Thus frequent keys keep their own sketches, while rare keys of a high-cardinality key share one.
+	 * The other_key entries (at most one per CallSite) are never evicted, so they may exceed the limit.
+	 */
+	class SketchTable {
+	public:
+		static constexpr uint64_t other_key = std::numeric_limits<uint64_t>::max();
+
+	private:
+		struct Key {
+			CallSiteId callsite;
+			uint64_t key;
+			bool operator==(const Key& other) const { return callsite == other.callsite && key == other.key; }
+		};
+		struct KeyHash {
+			size_t operator()(const Key& key) const {
+				size_t seed = std::hash<CallSiteId>{}(key.callsite);
+				seed ^= std::hash<uint64_t>{}(key.key) + 0x9e3779b9 + (seed << 6U) + (seed >> 2U);
+				return seed;
+			}
+		};
+
+		size_t max_keys;
+		std::vector<KeyedLatency> entries;
+		std::unordered_map<Key, size_t, KeyHash> indices;
+
+		KeyedLatency& get_entry(CallSiteId callsite, uint64_t key) {
+			auto it = indices.find(Key{callsite, key});
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(it != indices.end())) {
+				return entries[it->second];
+			}
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(max_keys != 0 && entries.size() >= max_keys && key != other_key)) {
+				evict();
+				// The other_key entries may have taken the last spots.
+				if (entries.size() >= max_keys) {
+					return get_entry(callsite, other_key);
+				}
+			}
+			indices.emplace(Key{callsite, key}, entries.size());
+			entries.push_back(KeyedLatency{callsite, key});
+			return entries.back();
+		}
+
+		void evict() {
+			std::vector<KeyedLatency> kept;
+			std::vector<KeyedLatency> evicted;
+			std::vector<KeyedLatency> by_count = std::move(entries);
+			std::sort(by_count.begin(), by_count.end(), [](const KeyedLatency& lhs, const KeyedLatency& rhs) {
+				return lhs.get_count() > rhs.get_count();
+			});
+			for (KeyedLatency& entry : by_count) {
+				(entry.key == other_key || kept.size() < max_keys / 2 ? kept : evicted).push_back(std::move(entry));
+			}
+			entries = std::move(kept);
+			indices.clear();
+			for (size_t i = 0; i < entries.size(); ++i) {
+				indices.emplace(Key{entries[i].callsite, entries[i].key}, i);
+			}
+			for (const KeyedLatency& entry : evicted) {
+				KeyedLatency& other = get_entry(entry.callsite, other_key);
+				other.cpu.merge(entry.cpu);
+				other.wall.merge(entry.wall);
+			}
+		}
+
+	public:
+		/**
+		 * @param max_keys_ the most entries to hold (0 for unbounded).
+		 */
+		explicit SketchTable(size_t max_keys_ = 0)
+			: max_keys{max_keys_}
+		{ }
+
+		/**
+		 * @brief Sets the most entries to hold (0 for unbounded), which takes effect at the next new key.
+		 */
+		void set_max_keys(size_t max_keys_) { max_keys = max_keys_; }
+
+		/**
+		 * @brief Counts one frame of @p callsite with @p key.
+		 */
+		void add(CallSiteId callsite, uint64_t key, CpuTime cpu, WallStamp wall) {
+			KeyedLatency& entry = get_entry(callsite, key);
+			entry.cpu.add(static_cast<uint64_t>(get_ns(cpu)));
+			entry.wall.add(wall);
+		}
+
+		void merge(const SketchTable& other) {
+			for (const KeyedLatency& entry : other.entries) {
+				KeyedLatency& into = get_entry(entry.callsite, entry.key);
+				into.cpu.merge(entry.cpu);
+				into.wall.merge(entry.wall);
+			}
+		}
+
+		/**
+		 * @brief The sketches for @p callsite with @p key, or nullptr if it has none (it may have been evicted to other_key).
+		 */
+		const KeyedLatency* find(CallSiteId callsite, uint64_t key) const {
+			auto it = indices.find(Key{callsite, key});
+			return it == indices.end() ? nullptr : &entries[it->second];
+		}
+
+		/**
+		 * @brief Every entry, in no particular order.
+		 */
+		const std::vector<KeyedLatency>& get_entries() const { return entries; }
+
+		void clear() {
+			entries.clear();
+			indices.clear();
+		}
+	};
+
+} // namespace charmonium::scope_timer::detail
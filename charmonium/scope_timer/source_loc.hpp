@@ -45,3 +45,5 @@ namespace charmonium::scope_timer::detail {
 	(charmonium::scope_timer::detail::SourceLoc {__func__, __FILE__, __LINE__})
 #define CHARMONIUM_SCOPE_TIMER_UNIQUE_NAME() \
 	CHARMONIUM_SCOPE_TIMER_TOKENPASTE(__scope_timer__, __LINE__)
+#define CHARMONIUM_SCOPE_TIMER_UNIQUE_CALLSITE_NAME() \
+	CHARMONIUM_SCOPE_TIMER_TOKENPASTE(__scope_timer_callsite__, __LINE__)
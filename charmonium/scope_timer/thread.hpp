@@ -1,9 +1,19 @@
 #pragma once // NOLINT(llvm-header-guard)
 #include "compiler_specific.hpp"
-#include "timer.hpp"
+#include "call_tree.hpp"
+#include "histogram.hpp"
+#include "live_stack.hpp"
+#include "rate_limit.hpp"
+#include "sampling.hpp"
+#include "sketch.hpp"
+#include "timers.hpp"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
 
 namespace charmonium::scope_timer::detail {
 	class Thread;
@@ -11,6 +21,36 @@ namespace charmonium::scope_timer::detail {
 	class Timer;
 	class ScopeTimer;
 
+	/**
+	 * @brief What a Thread does with a finished frame when its buffer is at capacity (see Process::set_buffer_capacity).
+	 */
+	enum class OverflowPolicy {
+		/// Discard the frame, counting it in Thread::get_num_dropped.
+		drop_newest,
+		/// Discard the oldest finished frame (counted likewise), so the buffer holds the most recent frames.
+		overwrite_oldest,
+		/// Call thread_in_situ synchronously, which should drain the buffer; if it does not, discard the frame.
+		flush,
+		/// Wait for another thread to call Thread::drain_finished or Thread::visit_finished (e.g. the collector); without one, this waits forever.
+		block,
+	};
+
+	/**
+	 * @brief When a Thread calls thread_in_situ; see Process::set_callback_period and friends.
+	 *
+	 * A zero disables that trigger; the Thread flushes when any enabled trigger fires.
+	 */
+	struct FlushTriggers {
+		/// CPU time since the last flush (1ns means every frame).
+		CpuTime cpu_period {0};
+		/// Wall time since the last flush.
+		WallTime wall_period {0};
+		/// Finished frames buffered.
+		size_t records {0};
+		/// Bytes of finished frames buffered (not counting spilled info payloads).
+		size_t bytes {0};
+	};
+
 	class CallbackType {
 	protected:
 		friend class Thread;
@@ -36,13 +76,68 @@ namespace charmonium::scope_timer::detail {
 		const std::thread::id id;
 		const std::thread::native_handle_type native_handle;
 		std::string name;
+		ThreadClocks clocks;
+		std::shared_ptr<TimerChunkPool> chunk_pool;
 		Timers stack;
-		mutable std::mutex finished_mutex;
-		Timers finished; // locked by finished_mutex
+		// Mirrors stack, for other threads to read, if use_live_stack (or in sampling mode).
+		LiveStack live_stack;
+		// Only this thread pushes; any thread may drain.
+		FinishedQueue finished;
+		// Only in sampling mode (see Process::set_sampling_period), where stack stays empty.
+		std::unique_ptr<SampleTree> samples;
+		SampleTimer sample_timer;
+		RateLimiter rate_limiter;
+		// Only when recording latency histograms (see Process::set_latency_histograms); lent by the Process.
+		LatencyRecorder* latencies;
+		// Only when sketching (see Process::set_sketch_key).
+		struct Sketching {
+			SketchKey key;
+			// Only the owner uses table, so exiting a frame takes no lock.
+			SketchTable table;
+			// Taken by the owner to publish table at a flush, and by drainers.
+			std::mutex mutex;
+			SketchTable published;
+		};
+		std::unique_ptr<Sketching> sketching;
+		// Only in aggregating mode (see Process::set_aggregating), where finished stays empty.
+		struct Aggregation {
+			// Only the owner uses tree and path, so exiting a frame takes no lock.
+			CallTree tree;
+			// The node of each frame in stack.
+			std::vector<uint32_t> path;
+			// Taken by the owner to publish tree at a flush, and by drainers.
+			std::mutex mutex;
+			CallTree published;
+		};
+		std::unique_ptr<Aggregation> aggregation;
+		std::atomic<size_t> dropped;
+		std::condition_variable finished_drained;
 		IndexNo index;
-		CpuTime last_log;
+		// The stop stamps of the frame which triggered the last flush.
+		CpuTime last_flush_cpu;
+		WallStamp last_flush_wall;
+
+		/*
+		 * Returns whether the frame was entered, in which case the caller must exit it (unless only_time_start).
+		 */
+		bool enter_stack_frame(CallSiteId callsite, TypeEraser&& info, bool only_time_start) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(samples)) {
+				// The signal handler reads live_stack, so that is all a frame costs.
+				if (!only_time_start) {
+					live_stack.push(callsite, 0, CpuTime{0});
+				}
+				return true;
+			}
+
+			// The root frame is never skipped.
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(get_rate_limit() != 0 && callsite != 0 && !rate_limiter.should_record(callsite))) {
+				return false;
+			}
+
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(aggregation)) {
+				aggregation->path.push_back(aggregation->path.empty() ? 0 : aggregation->tree.get_child(aggregation->path.back(), callsite));
+			}
 
-		void enter_stack_frame(const char* name, TypeEraser&& info, SourceLoc source_loc, bool only_time_start) {
 			IndexNo caller_index = 0;
 			IndexNo prev_index = 0;
 			IndexNo this_index = index++;
@@ -55,9 +150,7 @@ namespace charmonium::scope_timer::detail {
 			}
 
 			stack.emplace_back(
-				get_process_start(),
-				name,
-				std::move(source_loc),
+				callsite,
 				this_index,
 				caller_index,
 				prev_index,
@@ -65,53 +158,180 @@ namespace charmonium::scope_timer::detail {
 			);
 
 			// very last:
-			stack.back().start_timers();
+			stack.back().start_timers(clocks);
+			if (use_live_stack) {
+				live_stack.push(callsite, stack.back().get_wall_stamp(true), stack.back().get_start_cpu());
+			}
 
 			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(only_time_start)) {
 				stack.back().stop_from_start();
 				exit_stack_frame(true);
 			}
+			return true;
 		}
 
 		void exit_stack_frame(bool already_stopped = false) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(samples)) {
+				live_stack.pop();
+				return;
+			}
+
 			assert(!stack.empty() && "somehow exit_stack_frame was called more times than enter_stack_frame");
 
 			// (almost) very first:
 			if (CHARMONIUM_SCOPE_TIMER_LIKELY(!already_stopped)) {
-				stack.back().stop_timers();
+				stack.back().stop_timers(clocks);
 			}
+			stack.back().finish();
 
-			{
-				// std::lock_guard<std::mutex> finished_lock {finished_mutex};
-				finished.emplace_back(std::move(stack.back()));
+			if (CHARMONIUM_SCOPE_TIMER_LIKELY(stack.size() > 1)) {
+				stack[stack.size() - 2].add_child(stack.back());
+			}
+
+			size_t rate_limit = get_rate_limit();
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(rate_limit != 0 && stack.size() > 1)) {
+				rate_limiter.on_recorded(stack.back(), rate_limit);
+			}
+
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(latencies != nullptr)) {
+				const Timer& frame = stack.back();
+				latencies->record(frame.get_callsite_id(), frame.get_cpu_duration(), frame.get_exclusive_cpu(), frame.get_wall_stamps(), frame.get_exclusive_wall_stamps());
+			}
+
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(sketching)) {
+				const Timer& frame = stack.back();
+				sketching->table.add(frame.get_callsite_id(), sketching->key(frame), frame.get_cpu_duration(), frame.get_wall_stamps());
+			}
+
+			// Reading the clocks is expensive. Instead we look at the last frame.
+			CpuTime now_cpu = stack.back().get_stop_cpu();
+			WallStamp now_wall = stack.back().get_wall_stamp(false);
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(aggregation)) {
+				aggregation->tree.add(aggregation->path.back(), stack.back());
+				aggregation->path.pop_back();
+			// The root frame is always kept, so that thread_stop sees it.
+			} else if (CHARMONIUM_SCOPE_TIMER_LIKELY(!is_full() || stack.size() == 1 || make_room())) {
+				finished.push(std::move(stack.back()));
 			}
 			stack.pop_back();
+			if (use_live_stack) {
+				live_stack.pop();
+			}
 
-			maybe_flush();
+			if (should_flush(now_cpu, now_wall)) {
+				if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(sketching)) {
+					publish_sketches();
+				}
+				if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(aggregation)) {
+					publish_call_tree();
+				}
+				get_callback().thread_in_situ(*this);
+			}
 		}
 
-	public:
+		/*
+		 * Moves the owner's sketches into the ones drainers read.
+		 * Only the owning thread may call this.
+		 */
+		void publish_sketches() {
+			std::lock_guard<std::mutex> sketching_lock {sketching->mutex};
+			sketching->published.merge(sketching->table);
+			sketching->table.clear();
+		}
+
+		/*
+		 * Moves the owner's CallTree into the one drainers read.
+		 * Only the owning thread may call this.
+		 */
+		void publish_call_tree() {
+			std::lock_guard<std::mutex> aggregation_lock {aggregation->mutex};
+			aggregation->published.merge(aggregation->tree);
+			aggregation->tree.reset();
+		}
 
 		const Timer& get_top() const { return stack.back(); }
 		Timer& get_top() { return stack.back(); }
 
-		Thread(Process& process_, std::thread::id id_, std::thread::native_handle_type native_handle_, std::string&& name_)
+		/*
+		 * The signal handler finds the interrupted thread's Thread here.
+		 * This is an inline function, so every translation unit shares it.
+		 */
+		static Thread*& sampled_thread() {
+			static thread_local Thread* thread = nullptr;
+			return thread;
+		}
+
+		static void on_sample_signal(int /*signal*/) {
+			int saved_errno = errno;
+			Thread* thread = sampled_thread();
+			if (thread != nullptr) {
+				thread->samples->record(thread->live_stack);
+			}
+			errno = saved_errno;
+		}
+
+	public:
+
+		/**
+		 * @param allow_modes_ whether this Thread may sample (see Process::set_sampling_period; it also needs to be constructed on thread @p id_), record latency histograms (see Process::set_latency_histograms), sketch (see Process::set_sketch_key), or aggregate (see Process::set_aggregating).
+		 */
+		Thread(Process& process_, std::thread::id id_, std::thread::native_handle_type native_handle_, std::string&& name_, bool allow_modes_ = true)
 			: process{process_}
 			, id{id_}
 			, native_handle{native_handle_}
 			, name{std::move(name_)}
+			, clocks{
+				&get_wall_clock(),
+				CpuClock{ClockPolicy::cpu},
+				max_counters == 0 ? HardwareCounters{} : HardwareCounters{get_hardware_counter_config()},
+				SchedEvents{use_sched_events},
+			}
+			, chunk_pool{std::make_shared<TimerChunkPool>()}
+			, stack{chunk_pool}
+			, finished{chunk_pool}
+			, samples{allow_modes_ && get_ns(get_sampling_period()) != 0 && id_ == std::this_thread::get_id() ? new SampleTree : nullptr}
+			, sample_timer{samples ? SampleTimer{get_sampling_period()} : SampleTimer{}}
+			, latencies{allow_modes_ && get_latency_histograms() ? lend_latency_recorder() : nullptr}
+			, sketching{allow_modes_ ? make_sketching() : nullptr}
+			, aggregation{allow_modes_ && get_aggregating() ? new Aggregation : nullptr}
+			, dropped{0}
 			, index{0}
-			, last_log{0}
+			, last_flush_cpu{0}
+			, last_flush_wall{0}
 		{
-			enter_stack_frame("", TypeEraser{type_eraser_default}, SourceLoc{}, false);
+			enter_stack_frame(0, TypeEraser{type_eraser_default}, false);
+			if (samples) {
+				sampled_thread() = this;
+			} else {
+				last_flush_cpu = stack.back().get_start_cpu();
+				last_flush_wall = stack.back().get_wall_stamp(true);
+			}
 			get_callback().thread_start(*this);
 		}
 
 		~Thread() {
 			// std::cerr << "Thread::~Thread: " << id << std::endl;
+			if (samples) {
+				sample_timer.disarm();
+				if (sampled_thread() == this) {
+					sampled_thread() = nullptr;
+				}
+			}
 			exit_stack_frame();
 			assert(stack.empty() && "somewhow enter_stack_frame was called more times than exit_stack_frame");
 			get_callback().thread_stop(*this);
+			hand_off_to_collector();
+			if (latencies != nullptr) {
+				give_back_latency_recorder();
+			}
+			if (sketching) {
+				publish_sketches();
+				hand_off_sketches();
+			}
+			if (aggregation) {
+				publish_call_tree();
+				hand_off_call_tree();
+			}
 			// assert(finished.empty() && "flush() should drain this buffer, and nobody should be adding to it now. Somehow unflushed Timers are still present");
 		}
 
@@ -124,11 +344,27 @@ namespace charmonium::scope_timer::detail {
 			, id{other.id}
 			, native_handle{other.native_handle}
 			, name{std::move(other.name)}
+			, clocks{std::move(other.clocks)}
+			, chunk_pool{std::move(other.chunk_pool)}
 			, stack{std::move(other.stack)}
+			, live_stack{std::move(other.live_stack)}
 			, finished{std::move(other.finished)}
+			, samples{std::move(other.samples)}
+			, sample_timer{std::move(other.sample_timer)}
+			, rate_limiter{std::move(other.rate_limiter)}
+			, latencies{other.latencies}
+			, sketching{std::move(other.sketching)}
+			, aggregation{std::move(other.aggregation)}
+			, dropped{other.dropped.load()}
 			, index{other.index}
-			, last_log{other.last_log}
-		{ }
+			, last_flush_cpu{other.last_flush_cpu}
+			, last_flush_wall{other.last_flush_wall}
+		{
+			other.latencies = nullptr;
+			if (samples && sampled_thread() == &other) {
+				sampled_thread() = this;
+			}
+		}
 		Thread& operator=(Thread&& other) = delete;
 
 		std::thread::id get_id() const { return id; }
@@ -137,34 +373,193 @@ namespace charmonium::scope_timer::detail {
 
 		std::string get_name() const { return name; }
 
+		/**
+		 * @brief The source of CPU time for this thread's Timers.
+		 */
+		const CpuClock& get_cpu_clock() const { return clocks.cpu_clock; }
+
+		/**
+		 * @brief The hardware counters this thread's Timers record; see Timer::get_counter.
+		 */
+		const HardwareCounters& get_hardware_counters() const { return clocks.hardware_counters; }
+
+		/**
+		 * @brief The software events this thread's Timers record; see Timer::get_sched_counts.
+		 */
+		const SchedEvents& get_sched_events() const { return clocks.sched_events; }
+
 		void set_name(std::string&& name_) { name = std::move(name_); }
 
+		/**
+		 * @brief The open frames, oldest first. Only the owning thread may call this; other threads should use get_live_stack.
+		 */
 		const Timers& get_stack() const { return stack; }
 
+		/**
+		 * @brief The open frames' callsites and start times, which any thread may read (see LiveStack::read).
+		 *
+		 * This is empty unless CHARMONIUM_SCOPE_TIMER_LIVE_STACK is 1 or this thread samples.
+		 */
+		const LiveStack& get_live_stack() const { return live_stack; }
+
+		/**
+		 * @brief The samples of this thread's calling contexts, or nullptr if this thread does not sample (see Process::set_sampling_period).
+		 *
+		 * This may be called from any thread.
+		 */
+		const SampleTree* get_sample_tree() const { return samples.get(); }
+
+		/**
+		 * @brief This thread's calls and estimated times per CallSite, indexed by CallSiteId, while rate limiting (see Process::set_rate_limit).
+		 *
+		 * Only the owning thread may call this.
+		 */
+		const std::vector<CallSiteRate>& get_callsite_rates() const { return rate_limiter.get_rates(); }
+
+		/**
+		 * @brief Merges this thread's sketches, as of its last flush, into @p into, then clears them (see Process::set_sketch_key).
+		 *
+		 * Like the CallTree (see drain_call_tree), the thread sketches without locking, and publishes its sketches at each flush and when it exits.
+		 * This may be called from any thread.
+		 */
+		void drain_sketches(SketchTable& into) {
+			if (sketching) {
+				std::lock_guard<std::mutex> sketching_lock {sketching->mutex};
+				into.merge(sketching->published);
+				sketching->published.clear();
+			}
+		}
+
+		/**
+		 * @brief Whether this thread aggregates frames into a CallTree instead of keeping them (see Process::set_aggregating).
+		 */
+		bool is_aggregating() const { return static_cast<bool>(aggregation); }
+
+		/**
+		 * @brief Merges this thread's CallTree, as of its last flush, into @p into, then zeroes it.
+		 *
+		 * The thread folds frames into a private tree without locking, and publishes it at each flush
+		 * (when a FlushTrigger fires; see Process::set_callback_period and friends) and when it exits.
+		 * Frames finished since then, and frames still open, are not included. This may be called from any thread.
+		 */
+		void drain_call_tree(CallTree& into) {
+			if (aggregation) {
+				std::lock_guard<std::mutex> aggregation_lock {aggregation->mutex};
+				into.merge(aggregation->published);
+				aggregation->published.reset();
+			}
+		}
+
+		/**
+		 * @brief Takes the finished frames, in the order they finished.
+		 *
+		 * This may be called from any thread.
+		 */
 		Timers drain_finished() {
-			Timers finished_buffer;
-			finished.swap(finished_buffer);
+			// The batch returns its chunks to this thread's pool when it is destroyed.
+			Timers finished_buffer = finished.drain();
+			notify_drained();
 			return finished_buffer;
 		}
 
+		/**
+		 * @brief Streams the finished frames to @p visitor in place, in the order they finished, then discards them.
+		 *
+		 * @p visitor is called as `visitor(const Timer* begin, const Timer* end)` on contiguous spans,
+		 * which are only valid during the call.
+		 * Unlike drain_finished, this neither allocates nor moves frames, and their storage is reused.
+		 * This may be called from any thread.
+		 * Returns the number of frames visited.
+		 */
+		template <typename Visitor>
+		size_t visit_finished(Visitor&& visitor) {
+			size_t visited = finished.visit(std::forward<Visitor>(visitor));
+			notify_drained();
+			return visited;
+		}
+
+		/**
+		 * @brief The number of frames discarded because the buffer was at capacity.
+		 */
+		size_t get_num_dropped() const { return dropped.load(std::memory_order_relaxed); }
+
 	private:
-		void maybe_flush() {
-			std::lock_guard<std::mutex> finished_lock {finished_mutex};
-			// get CPU time is expensive. Instead we look at the last frame
-			if (!finished.empty()) {
-				CpuTime now = finished.back().get_stop_cpu();
+		void notify_drained() {
+			{
+				// Taking the lock orders this notify after a blocked producer's check.
+				std::lock_guard<std::mutex> consumer_lock {finished.get_consumer_mutex()};
+			}
+			finished_drained.notify_all();
+		}
 
-				// std::lock_guard<std::mutex> config_lock {process.config_mutex};
-				CpuTime process_callback_period = get_callback_period();
+		bool is_full() const {
+			size_t capacity = get_buffer_capacity();
+			return capacity != 0 && finished.size() >= capacity;
+		}
 
-				if (get_ns(process_callback_period) != 0 && (get_ns(process_callback_period) == 1 || now > last_log + process_callback_period)) {
-					get_callback().thread_in_situ(*this);
-				}
+		/*
+		 * Applies the OverflowPolicy.
+		 * Returns whether there is room for the frame being exited.
+		 */
+		bool make_room() {
+			switch (get_overflow_policy()) {
+			case OverflowPolicy::drop_newest:
+				break;
+			case OverflowPolicy::overwrite_oldest:
+				finished.pop_front();
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				break;
+			case OverflowPolicy::flush:
+				get_callback().thread_in_situ(*this);
+				break;
+			case OverflowPolicy::block: {
+				std::unique_lock<std::mutex> consumer_lock {finished.get_consumer_mutex()};
+				finished_drained.wait(consumer_lock, [this] { return !is_full(); });
+				break;
+			}
+			}
+			if (is_full()) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			return true;
+		}
+
+		bool should_flush(CpuTime now_cpu, WallStamp now_wall) {
+			// std::lock_guard<std::mutex> config_lock {process.config_mutex};
+			FlushTriggers triggers = get_flush_triggers();
+			if (get_ns(triggers.cpu_period) == 1) {
+				return true;
+			}
+			WallStamp wall_stamps = get_flush_wall_stamps();
+			bool flush =
+				(get_ns(triggers.cpu_period) != 0 && now_cpu > last_flush_cpu + triggers.cpu_period)
+				|| (wall_stamps != 0 && now_wall != 0 && now_wall - last_flush_wall > wall_stamps)
+				|| (triggers.records != 0 && finished.size() >= triggers.records)
+				|| (triggers.bytes != 0 && finished.size() * sizeof(Timer) >= triggers.bytes);
+			if (flush) {
+				last_flush_cpu = now_cpu;
+				last_flush_wall = now_wall;
 			}
+			return flush;
 		}
 
 		CallbackType& get_callback() const;
-		CpuTime get_callback_period() const;
-		WallTime get_process_start() const;
+		FlushTriggers get_flush_triggers() const;
+		WallStamp get_flush_wall_stamps() const;
+		CpuTime get_sampling_period() const;
+		size_t get_rate_limit() const;
+		bool get_latency_histograms() const;
+		LatencyRecorder* lend_latency_recorder();
+		void give_back_latency_recorder();
+		Sketching* make_sketching() const;
+		void hand_off_sketches();
+		bool get_aggregating() const;
+		void hand_off_call_tree();
+		void hand_off_to_collector();
+		size_t get_buffer_capacity() const;
+		OverflowPolicy get_overflow_policy() const;
+		const WallClock& get_wall_clock() const;
+		const std::vector<HardwareCounter>& get_hardware_counter_config() const;
 	};
 } // namespace charmonium::scope_timer::detail
@@ -0,0 +1,177 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "thread.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief The Threads of a Process, registered, deregistered, and iterated without locks.
+	 *
+	 * Each Thread lives in a cache-line-aligned slot of an intrusive list.
+	 * Slots are only ever pushed onto the list, never unlinked, so walking it needs no lock;
+	 * a slot whose thread has exited is reused by the next thread to register,
+	 * so the list grows with the most threads alive at once, not with thread churn.
+	 * Each slot's state packs a status with a generation, which is bumped each time the slot is freed.
+	 * Readers pin a live slot before visiting its Thread, and an exiting thread waits for the pins to drop before destroying its Thread;
+	 * neither ever waits on thread creation.
+	 */
+	class ThreadRegistry {
+	public:
+		static constexpr size_t cache_line = 64;
+
+	private:
+		static constexpr uint64_t vacant = 0;
+		static constexpr uint64_t claimed = 1;
+		static constexpr uint64_t live = 2;
+		static constexpr uint64_t retiring = 3;
+		static constexpr unsigned status_bits = 2;
+		static constexpr uint64_t status_mask = (uint64_t{1} << status_bits) - 1;
+
+		struct alignas(cache_line) Slot {
+			// Set before the slot is published, and never changed.
+			Slot* next {nullptr};
+			// The generation, shifted by status_bits, | the status.
+			std::atomic<uint64_t> state {vacant};
+			std::atomic<size_t> pins {0};
+			std::atomic<std::thread::id> id {std::thread::id{}};
+			// Only the owning thread uses this; it counts the translation units which registered the thread.
+			size_t use_count {0};
+			std::aligned_storage<sizeof(Thread), alignof(Thread)>::type storage;
+
+			Thread& get_thread() { return *reinterpret_cast<Thread*>(&storage); } // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+		};
+
+		std::atomic<Slot*> head {nullptr};
+
+		static uint64_t status(uint64_t state) { return state & status_mask; }
+
+		Slot* find_live(std::thread::id id) const {
+			for (Slot* slot = head.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+				if (status(slot->state.load(std::memory_order_acquire)) == live && slot->id.load(std::memory_order_relaxed) == id) {
+					return slot;
+				}
+			}
+			return nullptr;
+		}
+
+		Slot* claim() {
+			for (Slot* slot = head.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+				uint64_t state = slot->state.load(std::memory_order_relaxed);
+				if (status(state) == vacant && slot->state.compare_exchange_strong(state, state | claimed, std::memory_order_acquire, std::memory_order_relaxed)) {
+					return slot;
+				}
+			}
+			void* memory = nullptr;
+			if (posix_memalign(&memory, cache_line, sizeof(Slot)) != 0) {
+				throw std::bad_alloc{};
+			}
+			Slot* slot = new (memory) Slot;
+			slot->state.store(claimed, std::memory_order_relaxed);
+			slot->next = head.load(std::memory_order_relaxed);
+			while (!head.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) { }
+			return slot;
+		}
+
+		static void retire(Slot& slot) {
+			uint64_t state = slot.state.load(std::memory_order_relaxed);
+			slot.state.store((state & ~status_mask) | retiring, std::memory_order_seq_cst);
+			while (slot.pins.load(std::memory_order_seq_cst) != 0) {
+				std::this_thread::yield();
+			}
+			slot.get_thread().~Thread();
+			slot.state.store((((state >> status_bits) + 1) << status_bits) | vacant, std::memory_order_release);
+		}
+
+	public:
+		ThreadRegistry() = default;
+
+		/**
+		 * @brief Destroys every Thread still registered.
+		 */
+		~ThreadRegistry() {
+			Slot* slot = head.load(std::memory_order_acquire);
+			while (slot != nullptr) {
+				Slot* next = slot->next;
+				if (status(slot->state.load(std::memory_order_acquire)) == live) {
+					slot->get_thread().~Thread();
+				}
+				slot->~Slot();
+				std::free(slot); // NOLINT(cppcoreguidelines-no-malloc)
+				slot = next;
+			}
+		}
+
+		ThreadRegistry(const ThreadRegistry&) = delete;
+		ThreadRegistry& operator=(const ThreadRegistry&) = delete;
+		ThreadRegistry(ThreadRegistry&&) = delete;
+		ThreadRegistry& operator=(ThreadRegistry&&) = delete;
+
+		/**
+		 * @brief Registers thread @p id, constructing its Thread from @p args, or counts another use if it is already registered.
+		 *
+		 * If the Thread's constructor throws, the exception propagates and the thread is not registered.
+		 * Only the thread @p id may call this.
+		 */
+		template <typename... Args>
+		Thread& acquire(std::thread::id id, Args&&... args) {
+			Slot* slot = find_live(id);
+			if (slot == nullptr) {
+				slot = claim();
+				try {
+					new (&slot->storage) Thread(std::forward<Args>(args)...);
+				} catch (...) {
+					// Free the slot for the next thread, as retire would.
+					uint64_t state = slot->state.load(std::memory_order_relaxed);
+					slot->state.store((((state >> status_bits) + 1) << status_bits) | vacant, std::memory_order_release);
+					throw;
+				}
+				slot->id.store(id, std::memory_order_relaxed);
+				slot->use_count = 0;
+				slot->state.store((slot->state.load(std::memory_order_relaxed) & ~status_mask) | live, std::memory_order_release);
+			}
+			++slot->use_count;
+			return slot->get_thread();
+		}
+
+		/**
+		 * @brief Counts one fewer use of thread @p id, and destroys its Thread after the last.
+		 *
+		 * Only the thread @p id may call this.
+		 */
+		void release(std::thread::id id) {
+			Slot* slot = find_live(id);
+			if (slot != nullptr && --slot->use_count == 0) {
+				retire(*slot);
+			}
+		}
+
+		/**
+		 * @brief Calls `visitor(Thread&)` on every registered Thread, which stays alive during the call.
+		 *
+		 * This may be called from any thread. Threads which register or exit meanwhile may or may not be visited.
+		 */
+		template <typename Visitor>
+		void for_each(Visitor&& visitor) const {
+			for (Slot* slot = head.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+				uint64_t state = slot->state.load(std::memory_order_acquire);
+				if (status(state) != live) {
+					continue;
+				}
+				slot->pins.fetch_add(1, std::memory_order_seq_cst);
+				// The owner marks the slot retiring before waiting for pins, so if it is still live, the pin holds.
+				if (slot->state.load(std::memory_order_seq_cst) == state) {
+					visitor(slot->get_thread());
+				}
+				slot->pins.fetch_sub(1, std::memory_order_release);
+			}
+		}
+	};
+
+} // namespace charmonium::scope_timer::detail
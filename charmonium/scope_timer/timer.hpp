@@ -1,29 +1,315 @@
 #pragma once // NOLINT(llvm-header-guard)
+#include "callsite.hpp"
 #include "clock.hpp"
+#include "perf_event.hpp"
 #include "type_eraser.hpp"
 #include "source_loc.hpp"
 #include "util.hpp"
-#include <deque>
 #include <cassert>
 
+#ifndef CHARMONIUM_SCOPE_TIMER_GAPS
+#define CHARMONIUM_SCOPE_TIMER_GAPS 0
+#endif
+
 namespace charmonium::scope_timer::detail {
 
 	static constexpr bool use_fences = true;
 
-	using IndexNo = size_t;
+	/*
+	 * Whether Timers find their largest uninstrumented gap (see Timer::get_max_gap_wall and Timer::get_max_gap_cpu).
+	 * Gaps are measured on each clock which ClockPolicy reads.
+	 */
+	static constexpr bool use_gaps = CHARMONIUM_SCOPE_TIMER_GAPS != 0;
+
+	/*
+	 * Indices count the frames of one thread, so they wrap after 2^32 frames.
+	 */
+	using IndexNo = uint32_t;
 
 	class Thread;
 
+	/*
+	 * Durations are stored in 32 bits.
+	 * Below 2^31 they are exact; above, the top bit is set, and they are stored as a 26-bit mantissa and a 5-bit exponent
+	 * (relative error below 2^-25, saturating after 2^57).
+	 */
+	using EncodedDuration = uint32_t;
+
+	static EncodedDuration encode_duration(uint64_t duration) {
+		static constexpr uint64_t exact_limit = uint64_t{1} << 31U;
+		static constexpr unsigned mantissa_bits = 26;
+		static constexpr unsigned max_exponent = 31;
+		if (CHARMONIUM_SCOPE_TIMER_LIKELY(duration < exact_limit)) {
+			return static_cast<EncodedDuration>(duration);
+		}
+		unsigned exponent = 0;
+		while ((duration >> exponent) >= (uint64_t{1} << mantissa_bits)) {
+			++exponent;
+		}
+		if (exponent > max_exponent) {
+			return static_cast<EncodedDuration>(exact_limit | (max_exponent << mantissa_bits) | ((uint64_t{1} << mantissa_bits) - 1));
+		}
+		return static_cast<EncodedDuration>(exact_limit | (exponent << mantissa_bits) | (duration >> exponent));
+	}
+
+	static uint64_t decode_duration(EncodedDuration encoded) {
+		static constexpr unsigned mantissa_bits = 26;
+		if (CHARMONIUM_SCOPE_TIMER_LIKELY((encoded >> 31U) == 0)) {
+			return encoded;
+		}
+		unsigned exponent = (encoded >> mantissa_bits) & 31U;
+		uint64_t mantissa = encoded & ((uint32_t{1} << mantissa_bits) - 1);
+		return mantissa << exponent;
+	}
+
+	/*
+	 * These hold the stamps for one clock, if ClockPolicy says to read it.
+	 * The disabled specializations are empty, so Timer's layout shrinks via the empty-base optimization,
+	 * and their methods are no-ops, so the clock reads vanish at compile-time.
+	 */
+	template <bool enabled>
+	class WallStamps {
+	protected:
+		void start_wall_timer(const WallClock&) { }
+		void stop_wall_timer(const WallClock&) { }
+		void stop_wall_from_start() { }
+		WallTime wall_since_start(bool) const { return WallTime{0}; }
+		WallStamp get_wall_stamp(bool) const { return 0; }
+		void add_child_wall(const WallStamps&) { }
+		WallStamp get_wall_stamps() const { return 0; }
+		WallStamp get_children_wall_stamps() const { return 0; }
+		WallTime get_wall_duration() const { return WallTime{0}; }
+		WallTime get_children_wall() const { return WallTime{0}; }
+	};
+
+	template <>
+	class WallStamps<true> {
+	protected:
+		WallStamp start_wall {0};
+		// The stop is stored relative to the start.
+		EncodedDuration wall_duration {0};
+		// Sum of the children's durations, in stamp units.
+		EncodedDuration children_wall {0};
+
+		void start_wall_timer(const WallClock& wall_clock) { start_wall = wall_clock.stamp_start(); }
+		void stop_wall_timer(const WallClock& wall_clock) { wall_duration = encode_duration(wall_clock.stamp_stop() - start_wall); }
+		void stop_wall_from_start() { wall_duration = 0; }
+		WallTime wall_since_start(bool start) const {
+			return start_wall == 0 ? WallTime{0} : get_shared_wall_clock().since_start(get_wall_stamp(start));
+		}
+		WallStamp get_wall_stamp(bool start) const { return start ? start_wall : start_wall + get_wall_stamps(); }
+		void add_child_wall(const WallStamps& child) { children_wall = encode_duration(get_children_wall_stamps() + child.get_wall_stamps()); }
+		WallStamp get_wall_stamps() const { return decode_duration(wall_duration); }
+		WallStamp get_children_wall_stamps() const { return decode_duration(children_wall); }
+		WallTime get_wall_duration() const { return get_shared_wall_clock().to_duration(get_wall_stamps()); }
+		WallTime get_children_wall() const { return get_shared_wall_clock().to_duration(get_children_wall_stamps()); }
+	};
+
+	template <size_t n>
+	class CounterStamps {
+	protected:
+		// Before stop_counters, these are the counters at start; after, they are the change.
+		HardwareCounters::Values counters {};
+
+		void start_counters(const HardwareCounters& hardware_counters) { hardware_counters.read(counters); }
+		void stop_counters(const HardwareCounters& hardware_counters) {
+			HardwareCounters::Values now {};
+			hardware_counters.read(now);
+			for (size_t i = 0; i < n; ++i) {
+				counters[i] = now[i] - counters[i];
+			}
+		}
+		void stop_counters_from_start() { counters.fill(0); }
+		uint64_t get_counter_delta(size_t i) const { return counters.at(i); }
+	};
+
+	template <>
+	class CounterStamps<0> {
+	protected:
+		void start_counters(const HardwareCounters&) { }
+		void stop_counters(const HardwareCounters&) { }
+		void stop_counters_from_start() { }
+		uint64_t get_counter_delta(size_t) const { return 0; }
+	};
+
+	template <bool enabled>
+	class SchedStamps {
+	protected:
+		void start_sched(const SchedEvents&) { }
+		void stop_sched(const SchedEvents&) { }
+		void stop_sched_from_start() { }
+		SchedCounts get_sched_delta() const { return SchedCounts{}; }
+		uint32_t get_cpu_id(bool) const { return 0; }
+	};
+
+	template <>
+	class SchedStamps<true> {
+	protected:
+		// Before stop_sched, these are the counts at start; after, they are the change.
+		SchedCounts sched_counts;
+		uint32_t start_cpu_id {0};
+		uint32_t stop_cpu_id {0};
+
+		void start_sched(const SchedEvents& sched_events) {
+			sched_events.read(sched_counts);
+			start_cpu_id = sched_events.get_cpu_id();
+		}
+		void stop_sched(const SchedEvents& sched_events) {
+			stop_cpu_id = sched_events.get_cpu_id();
+			SchedCounts now = sched_counts;
+			sched_events.read(now);
+			sched_counts = now - sched_counts;
+		}
+		void stop_sched_from_start() {
+			sched_counts = SchedCounts{};
+			stop_cpu_id = start_cpu_id;
+		}
+		SchedCounts get_sched_delta() const { return sched_counts; }
+		uint32_t get_cpu_id(bool start) const { return start ? start_cpu_id : stop_cpu_id; }
+	};
+
+	/**
+	 * @brief The per-thread sources which Timer::start_timers and Timer::stop_timers read.
+	 */
+	struct ThreadClocks {
+		const WallClock* wall_clock;
+		CpuClock cpu_clock;
+		HardwareCounters hardware_counters;
+		SchedEvents sched_events;
+	};
+
+	/*
+	 * Subtracts, but does not go below zero.
+	 * Noise can make the correction larger than a very short frame, or a CPU clock read slightly earlier than the last.
+	 */
+	template <typename Duration>
+	static Duration saturating_sub(Duration lhs, Duration rhs) {
+		return lhs > rhs ? lhs - rhs : Duration{0};
+	}
+
+	/*
+	 * These find the largest stretch of a frame's time, on one clock, which no child covers.
+	 * Each child, as it exits, measures the gap since its elder sibling stopped (or since the frame started);
+	 * the frame, as it exits, measures the gap since its youngest child stopped.
+	 * Stamps are in the Clock's units (WallClock stamps, or CpuClock ns); Clock only tells the wall and CPU gaps apart.
+	 */
+	template <bool enabled, typename Clock>
+	class GapStamps {
+	protected:
+		void add_child_gap(uint64_t, uint64_t, uint64_t, IndexNo, CallSiteId) { }
+		void finish_gaps(uint64_t, uint64_t) { }
+		uint64_t get_max_gap_stamps() const { return 0; }
+		IndexNo get_max_gap_next_index() const { return 0; }
+		CallSiteId get_max_gap_next_callsite() const { return 0; }
+	};
+
+	template <typename Clock>
+	class GapStamps<true, Clock> {
+	protected:
+		// When the youngest child stopped, relative to this frame's start.
+		EncodedDuration children_end {0};
+		EncodedDuration max_gap {0};
+		// The child which ends the largest gap, or 0 if this frame's stop does.
+		IndexNo max_gap_next_index {0};
+		CallSiteId max_gap_next_callsite {0};
+
+		void add_child_gap(uint64_t start, uint64_t child_start, uint64_t child_stop, IndexNo child_index, CallSiteId child_callsite) {
+			uint64_t gap = saturating_sub(saturating_sub(child_start, start), decode_duration(children_end));
+			if (gap > decode_duration(max_gap)) {
+				max_gap = encode_duration(gap);
+				max_gap_next_index = child_index;
+				max_gap_next_callsite = child_callsite;
+			}
+			children_end = encode_duration(saturating_sub(child_stop, start));
+		}
+		void finish_gaps(uint64_t start, uint64_t stop) {
+			uint64_t gap = saturating_sub(saturating_sub(stop, start), decode_duration(children_end));
+			if (gap > decode_duration(max_gap)) {
+				max_gap = encode_duration(gap);
+				max_gap_next_index = 0;
+				max_gap_next_callsite = 0;
+			}
+		}
+		uint64_t get_max_gap_stamps() const { return decode_duration(max_gap); }
+		IndexNo get_max_gap_next_index() const { return max_gap_next_index; }
+		CallSiteId get_max_gap_next_callsite() const { return max_gap_next_callsite; }
+	};
+
+	template <bool enabled>
+	class CpuStamps {
+	protected:
+		void start_cpu_timer(const CpuClock&) { }
+		void stop_cpu_timer(const CpuClock&) { }
+		void stop_cpu_from_start() { }
+		CpuTime get_cpu(bool) const { return CpuTime{0}; }
+		void add_child_cpu(const CpuStamps&) { }
+		CpuTime get_cpu_duration() const { return CpuTime{0}; }
+		CpuTime get_children_cpu() const { return CpuTime{0}; }
+	};
+
+	template <>
+	class CpuStamps<true> {
+	protected:
+		CpuTime start_cpu {0};
+		// The stop is stored relative to the start.
+		EncodedDuration cpu_duration {0};
+		EncodedDuration children_cpu {0};
+
+		void start_cpu_timer(const CpuClock& cpu_clock) {
+			assert(start_cpu == CpuTime{0} && "timer already started");
+			start_cpu = cpu_clock.now();
+		}
+		void stop_cpu_timer(const CpuClock& cpu_clock) {
+			assert(start_cpu != CpuTime{0} && "timer never started");
+			cpu_duration = encode_duration(static_cast<uint64_t>(get_ns(saturating_sub(cpu_clock.now(), start_cpu))));
+		}
+		void stop_cpu_from_start() { cpu_duration = 0; }
+		CpuTime get_cpu(bool start) const { return start ? start_cpu : start_cpu + get_cpu_duration(); }
+		void add_child_cpu(const CpuStamps& child) { children_cpu = encode_duration(static_cast<uint64_t>(get_ns(get_children_cpu() + child.get_cpu_duration()))); }
+		CpuTime get_cpu_duration() const { return CpuTime{static_cast<int64_t>(decode_duration(cpu_duration))}; }
+		CpuTime get_children_cpu() const { return CpuTime{static_cast<int64_t>(decode_duration(children_cpu))}; }
+	};
+
+	/**
+	 * @brief The cost of instrumenting one frame, as measured when the Process was constructed.
+	 *
+	 * "Inside" is the part which lands between a frame's own start and stop stamps (roughly, one clock read).
+	 * "Outside" is the rest of entering and exiting, which only the caller sees.
+	 */
+	struct Overhead {
+		WallTime wall_inside {0};
+		WallTime wall_outside {0};
+		CpuTime cpu_inside {0};
+		CpuTime cpu_outside {0};
+	};
+
 	/**
 	 * @brief Timing and runtime data relating to one stack-frame.
+	 *
+	 * Clocks which ClockPolicy does not read are not stored, and their getters return 0.
+	 * The name and SourceLoc live once in the process's CallSiteTable, and stops are stored relative to starts,
+	 * so that a long-running thread's finished Timers stay small.
 	 */
-	class Timer {
+	class RateLimiter;
+
+	class Timer
+		: private WallStamps<ClockPolicy::wall>
+		, private CpuStamps<ClockPolicy::cpu>
+		, private CounterStamps<max_counters>
+		, private SchedStamps<use_sched_events>
+		, private GapStamps<use_gaps && ClockPolicy::wall, WallClock>
+		, private GapStamps<use_gaps && ClockPolicy::cpu, CpuClock>
+	{
 	private:
+		using WallGaps = GapStamps<use_gaps && ClockPolicy::wall, WallClock>;
+		using CpuGaps = GapStamps<use_gaps && ClockPolicy::cpu, CpuClock>;
+
 		friend class Thread;
+		friend class Process;
+		friend class RateLimiter;
+		friend class CallTree;
 
-		WallTime process_start;
-		const char* name;
-		SourceLoc source_loc;
+		CallSiteId callsite;
 
 		// I don't want to use Timer* for pointers to other frames,
 		// because they can be moved aroudn in memory (e.g. from stack to finished),
@@ -31,61 +317,75 @@ namespace charmonium::scope_timer::detail {
 		IndexNo index;
 		IndexNo caller_index;
 		IndexNo prev_index;
-		WallTime start_wall;
-		CpuTime start_cpu;
-		WallTime stop_wall;
-		CpuTime stop_cpu;
-		TypeEraser info;
-
 		IndexNo youngest_child_index;
+		IndexNo num_children;
+		IndexNo num_descendants;
+		TypeEraser info;
 
-		void start_timers() {
-			assert(start_cpu == CpuTime{0} && "timer already started");
+		void add_child(const Timer& child) {
+			add_child_wall(child);
+			add_child_cpu(child);
+			WallGaps::add_child_gap(get_wall_stamp(true), child.get_wall_stamp(true), child.get_wall_stamp(false), child.index, child.callsite);
+			CpuGaps::add_child_gap(cpu_ticks(get_cpu(true)), cpu_ticks(child.get_cpu(true)), cpu_ticks(child.get_cpu(false)), child.index, child.callsite);
+			++num_children;
+			num_descendants += 1 + child.num_descendants;
+		}
 
+		void start_timers(const ThreadClocks& clocks) {
+			// Sched events may cost a syscall, so read them outside the clocks, as stop_timers does.
+			start_sched(clocks.sched_events);
 			// very last thing:
 			if (use_fences) { fence(); }
-			start_wall = wall_now();
-			start_cpu = cpu_now();
+			start_wall_timer(*clocks.wall_clock);
+			start_cpu_timer(clocks.cpu_clock);
+			start_counters(clocks.hardware_counters);
 			if (use_fences) { fence(); }
 		}
-		void stop_timers() {
-			assert(stop_cpu == CpuTime{0} && "timer already started");
+		void stop_timers(const ThreadClocks& clocks) {
 			// almost very first thing:
 			if (use_fences) { fence(); }
-			stop_wall = wall_now();
-			stop_cpu = cpu_now();
+			stop_counters(clocks.hardware_counters);
+			stop_wall_timer(*clocks.wall_clock);
+			stop_cpu_timer(clocks.cpu_clock);
+			stop_sched(clocks.sched_events);
 			if (use_fences) { fence(); }
+		}
 
-			assert(start_cpu != CpuTime{0} && "timer never started");
+		/*
+		 * Call once this frame and all of its children have stopped.
+		 */
+		void finish() {
+			WallGaps::finish_gaps(get_wall_stamp(true), get_wall_stamp(false));
+			CpuGaps::finish_gaps(cpu_ticks(get_cpu(true)), cpu_ticks(get_cpu(false)));
 		}
 
+		static uint64_t cpu_ticks(CpuTime cpu) { return static_cast<uint64_t>(get_ns(cpu)); }
+
 		void stop_from_start() {
-			stop_cpu = start_cpu;
-			stop_wall = start_wall;
+			stop_counters_from_start();
+			stop_sched_from_start();
+			stop_cpu_from_start();
+			stop_wall_from_start();
 		}
 
+		WallStamp get_exclusive_wall_stamps() const { return saturating_sub(get_wall_stamps(), get_children_wall_stamps()); }
+
 	public:
 		Timer(
-			WallTime process_start_,
-			const char* name_,
-			SourceLoc&& source_loc_,
+			CallSiteId callsite_,
 			IndexNo index_,
 			IndexNo caller_index_,
 			IndexNo prev_index_,
 			TypeEraser&& info_
 		)
-			: process_start{process_start_}
-			, name{name_}
-			, source_loc{std::move(source_loc_)}
+			: callsite{callsite_}
 			, index{index_}
 			, caller_index{caller_index_}
 			, prev_index{prev_index_}
-			, start_wall{0}
-			, start_cpu{0}
-			, stop_wall{0}
-			, stop_cpu{0}
-			, info{std::move(info_)}
 			, youngest_child_index{0}
+			, num_children{0}
+			, num_descendants{0}
+			, info{std::move(info_)}
 		{ }
 
 		/**
@@ -94,9 +394,14 @@ namespace charmonium::scope_timer::detail {
 		const TypeEraser& get_info() const { return info; }
 		TypeEraser& get_info() { return info; }
 
-		const char* get_name() const { return name; }
+		const char* get_name() const { return get_shared_callsites().get(callsite).name; }
 
-		const SourceLoc& get_source_loc() const { return source_loc; }
+		const SourceLoc& get_source_loc() const { return get_shared_callsites().get(callsite).source_loc; }
+
+		/**
+		 * @brief The id of this frame's name and SourceLoc in the process's CallSiteTable.
+		 */
+		CallSiteId get_callsite_id() const { return callsite; }
 
 		/**
 		 * @brief The index of the "parent" Timer (the Timer which called this one).
@@ -117,12 +422,37 @@ namespace charmonium::scope_timer::detail {
 		/**
 		 * @brief See documentation of return type.
 		 */
-		WallTime get_stop_wall() const { return stop_wall == WallTime{0} ? WallTime{0} : stop_wall - process_start; }
+		WallTime get_stop_wall() const { return wall_since_start(false); }
 
 		/**
 		 * @brief See documentation of return type.
 		 */
-		CpuTime get_start_cpu() const { return start_cpu; }
+		CpuTime get_start_cpu() const { return get_cpu(true); }
+
+		/**
+		 * @brief The change in the @p i'th hardware counter (see Process::set_hardware_counters) during this frame.
+		 *
+		 * This is always 0 if CHARMONIUM_SCOPE_TIMER_MAX_COUNTERS is 0 or the counter was unavailable.
+		 */
+		uint64_t get_counter(size_t i) const { return get_counter_delta(i); }
+
+		/**
+		 * @brief Context switches, CPU migrations, and page faults during this frame.
+		 *
+		 * These explain the gap between wall time and CPU time.
+		 * This is always zero unless CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS is 1.
+		 */
+		SchedCounts get_sched_counts() const { return get_sched_delta(); }
+
+		/**
+		 * @brief The CPU this frame started on (0 unless CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS is 1).
+		 */
+		uint32_t get_start_cpu_id() const { return get_cpu_id(true); }
+
+		/**
+		 * @brief The CPU this frame stopped on (0 unless CHARMONIUM_SCOPE_TIMER_SCHED_EVENTS is 1).
+		 */
+		uint32_t get_stop_cpu_id() const { return get_cpu_id(false); }
 
 		/**
 		 * @brief An index (0..n) according to the order that Timers started (AKA pre-order).
@@ -132,18 +462,110 @@ namespace charmonium::scope_timer::detail {
 		/**
 		 * @brief See documentation of return type.
 		 */
-		WallTime get_start_wall() const { return start_wall == WallTime{0} ? WallTime{0} : start_wall - process_start; }
+		WallTime get_start_wall() const { return wall_since_start(true); }
 
 		/**
 		 * @brief See documentation of return type.
 		 */
-		CpuTime get_stop_cpu() const { return stop_cpu; }
+		CpuTime get_stop_cpu() const { return get_cpu(false); }
 
 		/**
 		 * @brief The index of the youngest child (the last direct callee of this frame).
 		 */
 		IndexNo get_youngest_callee_index() const { return youngest_child_index; }
 
+		/**
+		 * @brief The number of direct callees of this frame.
+		 */
+		IndexNo get_num_children() const { return num_children; }
+
+		/**
+		 * @brief The number of frames (transitively) called by this frame.
+		 */
+		IndexNo get_num_descendants() const { return num_descendants; }
+
+		/**
+		 * @brief Wall time of this frame not spent in its children (its "self" time).
+		 *
+		 * Each child adds its duration to its caller as it exits, so this needs no other frames.
+		 * Calls which were not recorded (rate-limited or disabled CallSites) count as their caller's own time.
+		 */
+		WallTime get_exclusive_wall() const { return get_shared_wall_clock().to_duration(get_exclusive_wall_stamps()); }
+
+		/**
+		 * @brief CPU time of this frame not spent in its children.
+		 */
+		CpuTime get_exclusive_cpu() const { return saturating_sub(get_cpu_duration(), get_children_cpu()); }
+
+		/**
+		 * @brief The longest stretch of this frame's wall time in which no child was running.
+		 *
+		 * This is where to add the next SCOPE_TIMER. It is always 0 unless CHARMONIUM_SCOPE_TIMER_GAPS is 1.
+		 */
+		WallTime get_max_gap_wall() const { return get_shared_wall_clock().to_duration(WallGaps::get_max_gap_stamps()); }
+
+		/**
+		 * @brief The index of the child which ends the longest gap, or 0 if this frame's stop ends it.
+		 *
+		 * The gap starts at that child's elder sibling (see get_prev_index) or, for the eldest child, at this frame's start.
+		 * If the gap ends at this frame's stop, it starts at the youngest child, or at the start for a leaf.
+		 */
+		IndexNo get_max_gap_next_index() const { return WallGaps::get_max_gap_next_index(); }
+
+		/**
+		 * @brief The CallSite of the child which ends the longest gap, or 0 if this frame's stop ends it.
+		 */
+		CallSiteId get_max_gap_next_callsite() const { return WallGaps::get_max_gap_next_callsite(); }
+
+		/**
+		 * @brief Like get_max_gap_wall, but the longest stretch of this frame's CPU time in which no child was running.
+		 *
+		 * A gap with much more wall than CPU time is spent waiting, not computing.
+		 */
+		CpuTime get_max_gap_cpu() const { return CpuTime{static_cast<int64_t>(CpuGaps::get_max_gap_stamps())}; }
+
+		/**
+		 * @brief Like get_max_gap_next_index, but for get_max_gap_cpu.
+		 */
+		IndexNo get_max_gap_cpu_next_index() const { return CpuGaps::get_max_gap_next_index(); }
+
+		/**
+		 * @brief Like get_max_gap_next_callsite, but for get_max_gap_cpu.
+		 */
+		CallSiteId get_max_gap_cpu_next_callsite() const { return CpuGaps::get_max_gap_next_callsite(); }
+
+		/**
+		 * @brief Wall time of this frame, less the instrumentation cost of itself and all of its descendants.
+		 *
+		 * Pass Process::get_overhead().
+		 */
+		WallTime get_corrected_wall(const Overhead& overhead) const {
+			return saturating_sub(get_wall_duration(), overhead.wall_inside + (overhead.wall_inside + overhead.wall_outside) * static_cast<int64_t>(num_descendants));
+		}
+
+		/**
+		 * @brief CPU time of this frame, less the instrumentation cost of itself and all of its descendants.
+		 */
+		CpuTime get_corrected_cpu(const Overhead& overhead) const {
+			return saturating_sub(get_cpu_duration(), overhead.cpu_inside + (overhead.cpu_inside + overhead.cpu_outside) * static_cast<int64_t>(num_descendants));
+		}
+
+		/**
+		 * @brief Wall time of this frame not spent in its children, less instrumentation cost.
+		 *
+		 * This equals get_corrected_wall() minus the children's get_corrected_wall().
+		 */
+		WallTime get_corrected_exclusive_wall(const Overhead& overhead) const {
+			return saturating_sub(get_wall_duration() - get_children_wall(), overhead.wall_inside + overhead.wall_outside * static_cast<int64_t>(num_children));
+		}
+
+		/**
+		 * @brief CPU time of this frame not spent in its children, less instrumentation cost.
+		 */
+		CpuTime get_corrected_exclusive_cpu(const Overhead& overhead) const {
+			return saturating_sub(get_cpu_duration() - get_children_cpu(), overhead.cpu_inside + overhead.cpu_outside * static_cast<int64_t>(num_children));
+		}
+
 		/**
 		 * @brief If this Timer calls no other frames
 		 */
@@ -157,6 +579,4 @@ namespace charmonium::scope_timer::detail {
 			<< " called by frame[" << frame.get_caller_index() << "]"
 			;
 	}
-
-	using Timers = std::deque<Timer>;
 } // namespace charmonium::scope_timer::detail
@@ -0,0 +1,523 @@
+#pragma once // NOLINT(llvm-header-guard)
+#include "compiler_specific.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace charmonium::scope_timer::detail {
+
+	/**
+	 * @brief Recycles the fixed-size chunks which hold Timers.
+	 *
+	 * Each Thread has one, shared with the batches it drains,
+	 * so a batch destroyed on any thread (even after its Thread) returns its chunks here.
+	 */
+	class TimerChunkPool {
+	public:
+		static constexpr size_t chunk_bits = 8;
+		static constexpr size_t chunk_size = size_t{1} << chunk_bits;
+		// Free chunks beyond this are returned to the allocator.
+		static constexpr size_t max_free = 64;
+
+		struct Chunk {
+			alignas(Timer) unsigned char storage[chunk_size * sizeof(Timer)];
+			// Links chunks within a FinishedQueue.
+			std::atomic<Chunk*> next {nullptr};
+			Timer* get(size_t i) { return reinterpret_cast<Timer*>(&storage[i * sizeof(Timer)]); } // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+		};
+
+	private:
+		std::mutex mutex;
+		std::vector<Chunk*> free_chunks; // locked by mutex
+
+	public:
+		TimerChunkPool() = default;
+		TimerChunkPool(const TimerChunkPool&) = delete;
+		TimerChunkPool& operator=(const TimerChunkPool&) = delete;
+		TimerChunkPool(TimerChunkPool&&) = delete;
+		TimerChunkPool& operator=(TimerChunkPool&&) = delete;
+		~TimerChunkPool() {
+			for (Chunk* chunk : free_chunks) {
+				delete chunk;
+			}
+		}
+
+		Chunk* acquire() {
+			{
+				// Once per chunk_size Timers, so this lock is off the per-frame path.
+				std::lock_guard<std::mutex> lock {mutex};
+				if (!free_chunks.empty()) {
+					Chunk* chunk = free_chunks.back();
+					free_chunks.pop_back();
+					chunk->next.store(nullptr, std::memory_order_relaxed);
+					return chunk;
+				}
+			}
+			return new Chunk;
+		}
+
+		void release(Chunk* chunk) {
+			{
+				std::lock_guard<std::mutex> lock {mutex};
+				if (free_chunks.size() < max_free) {
+					free_chunks.push_back(chunk);
+					return;
+				}
+			}
+			delete chunk;
+		}
+
+		size_t get_num_free() {
+			std::lock_guard<std::mutex> lock {mutex};
+			return free_chunks.size();
+		}
+	};
+
+	/**
+	 * @brief A sequence of Timers, stored in chunks which never move.
+	 *
+	 * Appending never moves existing Timers (references stay valid, as in a std::deque),
+	 * and only allocates once per TimerChunkPool::chunk_size Timers, from the pool if there is one.
+	 * Iterators are random-access.
+	 */
+	class Timers {
+	private:
+		friend class FinishedQueue;
+
+		using Chunk = TimerChunkPool::Chunk;
+		static constexpr size_t chunk_bits = TimerChunkPool::chunk_bits;
+		static constexpr size_t chunk_mask = TimerChunkPool::chunk_size - 1;
+
+		std::vector<Chunk*> chunks;
+		// The position of the first Timer in chunks.front(), which is only nonzero after pop_front.
+		size_t first {0};
+		size_t count {0};
+		std::shared_ptr<TimerChunkPool> pool;
+
+		Chunk* acquire() { return pool ? pool->acquire() : new Chunk; }
+
+		void release(Chunk* chunk) {
+			if (pool) {
+				pool->release(chunk);
+			} else {
+				delete chunk;
+			}
+		}
+
+		/*
+		 * Appends a chunk whose Timers [first_, first_ + count_) are constructed, taking ownership of it.
+		 * This must be the first chunk, or the previous chunk must be full.
+		 */
+		void adopt_chunk(Chunk* chunk, size_t first_, size_t count_) {
+			assert((chunks.empty() || ((first + count) & chunk_mask) == 0) && "adopted chunks must be contiguous");
+			assert((chunks.empty() || first_ == 0) && "adopted chunks must be contiguous");
+			if (chunks.empty()) {
+				first = first_;
+			}
+			chunks.push_back(chunk);
+			count += count_;
+		}
+
+		Timer* slot(size_t i) const {
+			i += first;
+			return chunks[i >> chunk_bits]->get(i & chunk_mask);
+		}
+
+		template <bool is_const>
+		class Iterator {
+		private:
+			using Container = typename std::conditional<is_const, const Timers, Timers>::type;
+			Container* timers;
+			size_t pos;
+
+		public:
+			using iterator_category = std::random_access_iterator_tag;
+			using value_type = Timer;
+			using difference_type = std::ptrdiff_t;
+			using pointer = typename std::conditional<is_const, const Timer*, Timer*>::type;
+			using reference = typename std::conditional<is_const, const Timer&, Timer&>::type;
+
+			Iterator() : timers{nullptr}, pos{0} { }
+			Iterator(Container* timers_, size_t pos_) : timers{timers_}, pos{pos_} { }
+			// NOLINTNEXTLINE(google-explicit-constructor,hicpp-explicit-conversions)
+			operator Iterator<true>() const { return Iterator<true>{timers, pos}; }
+
+			reference operator*() const { return *timers->slot(pos); }
+			pointer operator->() const { return timers->slot(pos); }
+			reference operator[](difference_type n) const { return *timers->slot(pos + n); }
+
+			Iterator& operator++() { ++pos; return *this; }
+			Iterator operator++(int) { Iterator old = *this; ++pos; return old; }
+			Iterator& operator--() { --pos; return *this; }
+			Iterator operator--(int) { Iterator old = *this; --pos; return old; }
+			Iterator& operator+=(difference_type n) { pos += n; return *this; }
+			Iterator& operator-=(difference_type n) { pos -= n; return *this; }
+			Iterator operator+(difference_type n) const { return Iterator{timers, pos + n}; }
+			friend Iterator operator+(difference_type n, const Iterator& it) { return it + n; }
+			Iterator operator-(difference_type n) const { return Iterator{timers, pos - n}; }
+			difference_type operator-(const Iterator& other) const { return static_cast<difference_type>(pos) - static_cast<difference_type>(other.pos); }
+
+			bool operator==(const Iterator& other) const { return pos == other.pos; }
+			bool operator!=(const Iterator& other) const { return pos != other.pos; }
+			bool operator<(const Iterator& other) const { return pos < other.pos; }
+			bool operator>(const Iterator& other) const { return pos > other.pos; }
+			bool operator<=(const Iterator& other) const { return pos <= other.pos; }
+			bool operator>=(const Iterator& other) const { return pos >= other.pos; }
+		};
+
+	public:
+		using value_type = Timer;
+		using size_type = size_t;
+		using difference_type = std::ptrdiff_t;
+		using reference = Timer&;
+		using const_reference = const Timer&;
+		using iterator = Iterator<false>;
+		using const_iterator = Iterator<true>;
+
+		Timers() = default;
+
+		/**
+		 * @brief An empty sequence which takes its chunks from (and returns them to) @p pool_.
+		 */
+		explicit Timers(std::shared_ptr<TimerChunkPool> pool_)
+			: pool{std::move(pool_)}
+		{ }
+
+		template <typename InputIt>
+		Timers(InputIt first, InputIt last) {
+			insert(end(), first, last);
+		}
+
+		Timers(const Timers& other)
+			: pool{other.pool}
+		{
+			insert(end(), other.cbegin(), other.cend());
+		}
+
+		Timers(Timers&& other) noexcept
+			: chunks{std::move(other.chunks)}
+			, first{other.first}
+			, count{other.count}
+			, pool{std::move(other.pool)}
+		{
+			other.chunks.clear();
+			other.first = 0;
+			other.count = 0;
+		}
+
+		Timers& operator=(const Timers& other) {
+			if (this != &other) {
+				Timers copy {other};
+				swap(copy);
+			}
+			return *this;
+		}
+
+		Timers& operator=(Timers&& other) noexcept {
+			if (this != &other) {
+				clear();
+				swap(other);
+			}
+			return *this;
+		}
+
+		~Timers() { clear(); }
+
+		void swap(Timers& other) noexcept {
+			chunks.swap(other.chunks);
+			std::swap(first, other.first);
+			std::swap(count, other.count);
+			pool.swap(other.pool);
+		}
+
+		template <typename... Args>
+		Timer& emplace_back(Args&&... args) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(((first + count) & chunk_mask) == 0 && ((first + count) >> chunk_bits) == chunks.size())) {
+				chunks.push_back(acquire());
+			}
+			Timer* timer = new (slot(count)) Timer(std::forward<Args>(args)...);
+			++count;
+			return *timer;
+		}
+
+		void push_back(const Timer& timer) { emplace_back(timer); }
+		void push_back(Timer&& timer) { emplace_back(std::move(timer)); }
+
+		void pop_back() {
+			assert(count != 0);
+			--count;
+			slot(count)->~Timer();
+			// Keep one spare chunk, so a stack bouncing across a chunk boundary does not churn the pool.
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(((first + count) & chunk_mask) == 0 && chunks.size() > ((first + count) >> chunk_bits) + 1)) {
+				release(chunks.back());
+				chunks.pop_back();
+			}
+		}
+
+		/**
+		 * @brief Destroys the oldest Timer, returning its chunk to the pool once that chunk is empty.
+		 */
+		void pop_front() {
+			assert(count != 0);
+			slot(0)->~Timer();
+			++first;
+			--count;
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(first == TimerChunkPool::chunk_size)) {
+				release(chunks.front());
+				chunks.erase(chunks.begin());
+				first = 0;
+			}
+		}
+
+		/**
+		 * @brief Destroys every Timer and returns every chunk to the pool.
+		 */
+		void clear() {
+			for (size_t i = 0; i < count; ++i) {
+				slot(i)->~Timer();
+			}
+			for (Chunk* chunk : chunks) {
+				release(chunk);
+			}
+			chunks.clear();
+			first = 0;
+			count = 0;
+		}
+
+		template <typename InputIt>
+		iterator insert(const_iterator pos, InputIt first, InputIt last) {
+			assert(pos == cend() && "Timers only supports inserting at the end");
+			static_cast<void>(pos);
+			size_t start = count;
+			for (; first != last; ++first) {
+				emplace_back(*first);
+			}
+			return iterator{this, start};
+		}
+
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+
+		Timer& operator[](size_t i) { return *slot(i); }
+		const Timer& operator[](size_t i) const { return *slot(i); }
+		Timer& at(size_t i) {
+			if (i >= count) { throw std::out_of_range{"Timers::at"}; }
+			return *slot(i);
+		}
+		const Timer& at(size_t i) const {
+			if (i >= count) { throw std::out_of_range{"Timers::at"}; }
+			return *slot(i);
+		}
+		Timer& front() { return *slot(0); }
+		const Timer& front() const { return *slot(0); }
+		Timer& back() { return *slot(count - 1); }
+		const Timer& back() const { return *slot(count - 1); }
+
+		iterator begin() { return iterator{this, 0}; }
+		iterator end() { return iterator{this, count}; }
+		const_iterator begin() const { return const_iterator{this, 0}; }
+		const_iterator end() const { return const_iterator{this, count}; }
+		const_iterator cbegin() const { return begin(); }
+		const_iterator cend() const { return end(); }
+	};
+
+	/**
+	 * @brief A single-producer, single-consumer queue of finished Timers.
+	 *
+	 * The owning Thread pushes without locking; published Timers are visible to the consumer through
+	 * an acquire-load of the produced cursor, and consumed slots are visible to the producer through the consumed cursor.
+	 * Consumers (drain_finished and visit_finished, on any thread) serialize among themselves with consumer_mutex.
+	 * Chunks which the producer has filled are handed to the drained batch whole, without moving their Timers.
+	 */
+	class FinishedQueue {
+	private:
+		using Chunk = TimerChunkPool::Chunk;
+		static constexpr size_t chunk_size = TimerChunkPool::chunk_size;
+
+		std::shared_ptr<TimerChunkPool> pool;
+
+		// Producer's side:
+		Chunk* tail;
+		size_t tail_pos;
+		std::atomic<uint64_t> produced;
+
+		// Consumer's side:
+		mutable std::mutex consumer_mutex;
+		Chunk* head; // locked by consumer_mutex
+		size_t head_pos; // locked by consumer_mutex
+		std::atomic<uint64_t> consumed;
+
+		/*
+		 * Moves to the next chunk, if the current one is used up and the producer has moved on.
+		 * Called with consumer_mutex held.
+		 */
+		void advance_head() {
+			if (head_pos == chunk_size) {
+				Chunk* next = head->next.load(std::memory_order_acquire);
+				if (next != nullptr) {
+					pool->release(head);
+					head = next;
+					head_pos = 0;
+				}
+			}
+		}
+
+	public:
+		explicit FinishedQueue(std::shared_ptr<TimerChunkPool> pool_)
+			: pool{std::move(pool_)}
+			, tail{pool->acquire()}
+			, tail_pos{0}
+			, produced{0}
+			, head{tail}
+			, head_pos{0}
+			, consumed{0}
+		{ }
+
+		FinishedQueue(const FinishedQueue&) = delete;
+		FinishedQueue& operator=(const FinishedQueue&) = delete;
+		FinishedQueue& operator=(FinishedQueue&&) = delete;
+
+		/*
+		 * Not thread-safe; only for moving a Thread before it is shared.
+		 */
+		FinishedQueue(FinishedQueue&& other) noexcept
+			: pool{other.pool}
+			, tail{other.tail}
+			, tail_pos{other.tail_pos}
+			, produced{other.produced.load(std::memory_order_relaxed)}
+			, head{other.head}
+			, head_pos{other.head_pos}
+			, consumed{other.consumed.load(std::memory_order_relaxed)}
+		{
+			other.tail = other.head = nullptr;
+			other.produced.store(0, std::memory_order_relaxed);
+			other.consumed.store(0, std::memory_order_relaxed);
+		}
+
+		~FinishedQueue() {
+			if (head == nullptr) {
+				return;
+			}
+			for (uint64_t i = consumed.load(std::memory_order_relaxed); i < produced.load(std::memory_order_relaxed); ++i) {
+				advance_head();
+				head->get(head_pos++)->~Timer();
+			}
+			while (head != nullptr) {
+				Chunk* next = head->next.load(std::memory_order_relaxed);
+				pool->release(head);
+				head = next;
+			}
+		}
+
+		/**
+		 * @brief Publishes @p timer to the consumer. Only the owning thread may call this.
+		 */
+		void push(Timer&& timer) {
+			if (CHARMONIUM_SCOPE_TIMER_UNLIKELY(tail_pos == chunk_size)) {
+				Chunk* next = pool->acquire();
+				tail->next.store(next, std::memory_order_release);
+				tail = next;
+				tail_pos = 0;
+			}
+			new (tail->get(tail_pos)) Timer(std::move(timer));
+			++tail_pos;
+			produced.store(produced.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		/**
+		 * @brief The number of Timers pushed but not yet consumed.
+		 */
+		size_t size() const {
+			return static_cast<size_t>(produced.load(std::memory_order_acquire) - consumed.load(std::memory_order_acquire));
+		}
+
+		/**
+		 * @brief Takes every published Timer, in the order they were pushed.
+		 */
+		Timers drain() {
+			Timers batch {pool};
+			std::lock_guard<std::mutex> consumer_lock {consumer_mutex};
+			uint64_t consumed_ = consumed.load(std::memory_order_relaxed);
+			uint64_t available = produced.load(std::memory_order_acquire) - consumed_;
+			while (available != 0) {
+				advance_head();
+				size_t in_head = static_cast<size_t>(std::min<uint64_t>(available, chunk_size - head_pos));
+				Chunk* next = head->next.load(std::memory_order_acquire);
+				if (head_pos + in_head == chunk_size && next != nullptr && (batch.empty() || head_pos == 0)) {
+					// The producer is done with this chunk, so hand it over whole.
+					batch.adopt_chunk(head, head_pos, in_head);
+					head = next;
+					head_pos = 0;
+				} else {
+					for (size_t i = head_pos; i < head_pos + in_head; ++i) {
+						batch.emplace_back(std::move(*head->get(i)));
+						head->get(i)->~Timer();
+					}
+					head_pos += in_head;
+				}
+				available -= in_head;
+				consumed_ += in_head;
+			}
+			consumed.store(consumed_, std::memory_order_release);
+			return batch;
+		}
+
+		/**
+		 * @brief Calls `visitor(begin, end)` on every published Timer in place, then destroys them.
+		 *
+		 * `[begin, end)` is a contiguous span of `const Timer`, valid only during the call,
+		 * and there is one span per chunk, in the order they were pushed.
+		 * Used-up chunks return to the pool, so nothing is allocated, moved, or copied.
+		 * If the visitor throws, its span is not consumed.
+		 * Returns the number of Timers visited.
+		 */
+		template <typename Visitor>
+		size_t visit(Visitor&& visitor) {
+			std::lock_guard<std::mutex> consumer_lock {consumer_mutex};
+			uint64_t consumed_ = consumed.load(std::memory_order_relaxed);
+			uint64_t available = produced.load(std::memory_order_acquire) - consumed_;
+			size_t visited = static_cast<size_t>(available);
+			while (available != 0) {
+				advance_head();
+				size_t in_head = static_cast<size_t>(std::min<uint64_t>(available, chunk_size - head_pos));
+				const Timer* span = head->get(head_pos);
+				visitor(span, span + in_head);
+				for (size_t i = head_pos; i < head_pos + in_head; ++i) {
+					head->get(i)->~Timer();
+				}
+				head_pos += in_head;
+				available -= in_head;
+				consumed_ += in_head;
+				consumed.store(consumed_, std::memory_order_release);
+			}
+			return visited;
+		}
+
+		/**
+		 * @brief Destroys the oldest published Timer, if there is one.
+		 */
+		void pop_front() {
+			std::lock_guard<std::mutex> consumer_lock {consumer_mutex};
+			uint64_t consumed_ = consumed.load(std::memory_order_relaxed);
+			if (produced.load(std::memory_order_acquire) != consumed_) {
+				advance_head();
+				head->get(head_pos++)->~Timer();
+				consumed.store(consumed_ + 1, std::memory_order_release);
+			}
+		}
+
+		/**
+		 * @brief The lock which consumers hold, for waiting on them (see OverflowPolicy::block).
+		 */
+		std::mutex& get_consumer_mutex() const { return consumer_mutex; }
+	};
+
+} // namespace charmonium::scope_timer::detail
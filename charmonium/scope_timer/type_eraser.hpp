@@ -1,10 +1,246 @@
-#pragma once
+#pragma once // NOLINT(llvm-header-guard)
 
+#include <atomic>
+#include <cassert>
+#include <cstddef>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifndef CHARMONIUM_SCOPE_TIMER_INFO_CAPACITY
+#define CHARMONIUM_SCOPE_TIMER_INFO_CAPACITY 8
+#endif
 
 namespace charmonium::scope_timer::detail {
-	// In C++17, consider using std::any
-	using TypeEraser = std::shared_ptr<void>;
+
+	/**
+	 * @brief A value of any type, attached to a Timer as its info.
+	 *
+	 * Trivially copyable values of up to CHARMONIUM_SCOPE_TIMER_INFO_CAPACITY bytes are stored in place,
+	 * so attaching them does not allocate.
+	 * Other values are spilled to the heap, owned by this TypeEraser alone;
+	 * copying the TypeEraser copies the value, and there is no reference count.
+	 * Spilled values which cannot be copied (e.g. a unique_ptr) are instead shared by the copies, with a reference count.
+	 */
+	class TypeEraser {
+	public:
+		static constexpr size_t capacity = CHARMONIUM_SCOPE_TIMER_INFO_CAPACITY;
+
+	private:
+		union Storage {
+			unsigned char bytes[capacity];
+			void* spilled;
+		};
+
+		/*
+		 * One of these exists per stored type.
+		 * Inline values need neither copy nor destroy, since their bytes are copied with the Storage.
+		 */
+		struct Ops {
+			void (*copy)(const Storage& src, Storage& dst);
+			void (*destroy)(Storage& storage);
+		};
+
+		template <typename T>
+		struct is_inline : std::integral_constant<bool,
+			std::is_trivially_copyable<T>::value && sizeof(T) <= capacity && alignof(T) <= alignof(Storage)
+		> { };
+
+		/*
+		 * A spilled value which cannot be copied, shared by the copies of its TypeEraser.
+		 */
+		template <typename T>
+		struct Shared {
+			std::atomic<size_t> count {1};
+			std::unique_ptr<T> value;
+			explicit Shared(T* value_) : value{value_} { }
+		};
+
+		template <typename T>
+		static void* spill(T* ptr, std::true_type /*copyable*/) { return ptr; }
+
+		template <typename T>
+		static void* spill(T* ptr, std::false_type /*copyable*/) { return new Shared<T>{ptr}; }
+
+		template <typename T>
+		static const T* get_spilled(const Storage& storage, std::true_type /*copyable*/) { return static_cast<const T*>(storage.spilled); }
+
+		template <typename T>
+		static const T* get_spilled(const Storage& storage, std::false_type /*copyable*/) { return static_cast<const Shared<T>*>(storage.spilled)->value.get(); }
+
+		template <typename T>
+		static void copy_spilled(const Storage& src, Storage& dst, std::true_type /*copyable*/) {
+			dst.spilled = new T(*static_cast<const T*>(src.spilled));
+		}
+
+		template <typename T>
+		static void copy_spilled(const Storage& src, Storage& dst, std::false_type /*copyable*/) {
+			static_cast<Shared<T>*>(src.spilled)->count.fetch_add(1, std::memory_order_relaxed);
+			dst.spilled = src.spilled;
+		}
+
+		template <typename T>
+		static void copy_spilled(const Storage& src, Storage& dst) {
+			copy_spilled<T>(src, dst, std::is_copy_constructible<T>{});
+		}
+
+		template <typename T>
+		static void destroy_spilled(Storage& storage, std::true_type /*copyable*/) {
+			delete static_cast<T*>(storage.spilled);
+		}
+
+		template <typename T>
+		static void destroy_spilled(Storage& storage, std::false_type /*copyable*/) {
+			auto* shared = static_cast<Shared<T>*>(storage.spilled);
+			if (shared->count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				delete shared;
+			}
+		}
+
+		template <typename T>
+		static void destroy_spilled(Storage& storage) {
+			destroy_spilled<T>(storage, std::is_copy_constructible<T>{});
+		}
+
+		template <typename T, bool inline_ = is_inline<T>::value>
+		struct OpsOf {
+			static const Ops ops;
+		};
+
+		Storage storage;
+		const Ops* ops;
+
+		template <typename T, typename... Args>
+		void emplace(std::true_type /*inline*/, Args&&... args) {
+			new (&storage.bytes) T(std::forward<Args>(args)...);
+		}
+
+		template <typename T, typename... Args>
+		void emplace(std::false_type /*inline*/, Args&&... args) {
+			storage.spilled = spill<T>(new T(std::forward<Args>(args)...), std::is_copy_constructible<T>{});
+		}
+
+		template <typename T>
+		void adopt(std::true_type /*inline*/, T* ptr) {
+			emplace<T>(std::true_type{}, *ptr);
+			delete ptr;
+		}
+
+		template <typename T>
+		void adopt(std::false_type /*inline*/, T* ptr) {
+			storage.spilled = spill<T>(ptr, std::is_copy_constructible<T>{});
+		}
+
+		void reset() {
+			if (ops != nullptr && ops->destroy != nullptr) {
+				ops->destroy(storage);
+			}
+			ops = nullptr;
+		}
+
+	public:
+		TypeEraser()
+			: storage{}
+			, ops{nullptr}
+		{ }
+
+		TypeEraser(const TypeEraser& other)
+			: storage(other.storage)
+			, ops{other.ops}
+		{
+			if (ops != nullptr && ops->copy != nullptr) {
+				ops->copy(other.storage, storage);
+			}
+		}
+
+		TypeEraser(TypeEraser&& other) noexcept
+			: storage(other.storage)
+			, ops{other.ops}
+		{
+			other.ops = nullptr;
+		}
+
+		TypeEraser& operator=(const TypeEraser& other) {
+			if (this != &other) {
+				TypeEraser copy {other};
+				*this = std::move(copy);
+			}
+			return *this;
+		}
+
+		TypeEraser& operator=(TypeEraser&& other) noexcept {
+			if (this != &other) {
+				reset();
+				storage = other.storage;
+				ops = other.ops;
+				other.ops = nullptr;
+			}
+			return *this;
+		}
+
+		~TypeEraser() { reset(); }
+
+		/**
+		 * @brief Constructs a T in this TypeEraser, in place if it fits.
+		 */
+		template <typename T, typename... Args>
+		static TypeEraser make(Args&&... args) {
+			TypeEraser type_eraser;
+			type_eraser.emplace<T>(is_inline<T>{}, std::forward<Args>(args)...);
+			type_eraser.ops = &OpsOf<T>::ops;
+			return type_eraser;
+		}
+
+		/**
+		 * @brief Takes ownership of @p ptr (which must come from `new`).
+		 */
+		template <typename T>
+		static TypeEraser adopt(T* ptr) {
+			TypeEraser type_eraser;
+			type_eraser.adopt<T>(is_inline<T>{}, ptr);
+			type_eraser.ops = &OpsOf<T>::ops;
+			return type_eraser;
+		}
+
+		/**
+		 * @brief The stored value, which must have been made as a T.
+		 */
+		template <typename T>
+		const T& get() const {
+			assert(ops == &OpsOf<T>::ops && "TypeEraser extracted as a different type than it was made with");
+			return is_inline<T>::value
+				? *reinterpret_cast<const T*>(&storage.bytes) // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+				: *get_spilled<T>(storage, std::is_copy_constructible<T>{});
+		}
+
+		template <typename T>
+		T& get() {
+			return const_cast<T&>(static_cast<const TypeEraser&>(*this).get<T>()); // NOLINT(cppcoreguidelines-pro-type-const-cast)
+		}
+
+		/**
+		 * @brief Whether this holds a value made as a T.
+		 */
+		template <typename T>
+		bool holds() const { return ops == &OpsOf<T>::ops; }
+
+		/**
+		 * @brief Whether this holds a value.
+		 */
+		explicit operator bool() const { return ops != nullptr; }
+	};
+
+	template <typename T>
+	struct TypeEraser::OpsOf<T, true> {
+		static const Ops ops;
+	};
+
+	template <typename T, bool inline_>
+	const TypeEraser::Ops TypeEraser::OpsOf<T, inline_>::ops = {&TypeEraser::copy_spilled<T>, &TypeEraser::destroy_spilled<T>};
+
+	template <typename T>
+	const TypeEraser::Ops TypeEraser::OpsOf<T, true>::ops = {nullptr, nullptr};
 
 	static const TypeEraser type_eraser_default = TypeEraser{};
 
@@ -15,6 +15,33 @@ namespace charmonium::scope_timer::detail {
 		std::atomic_thread_fence(std::memory_order_seq_cst);
 	}
 
+	/**
+	 * @brief Whether @p str matches @p pattern, in which `*` matches any run of characters and `?` matches any one.
+	 */
+	static bool glob_match(const char* pattern, const char* str) {
+		// Where to resume after the last `*`, if the rest fails to match.
+		const char* star = nullptr;
+		const char* star_str = nullptr;
+		while (*str != '\0') {
+			if (*pattern == '*') {
+				star = pattern++;
+				star_str = str;
+			} else if (*pattern == '?' || *pattern == *str) {
+				++pattern;
+				++str;
+			} else if (star != nullptr) {
+				pattern = star + 1;
+				str = ++star_str;
+			} else {
+				return false;
+			}
+		}
+		while (*pattern == '*') {
+			++pattern;
+		}
+		return *pattern == '\0';
+	}
+
 	template <typename Map, typename RevMap>
 	typename Map::mapped_type lookup(Map& map, RevMap& reverse_map, typename Map::key_type word) {
 		auto it = map.find(word);
@@ -33,6 +33,12 @@ int main() {
     // This is a compromise between callback_once and callback_every.
     //proc.set_callback_period(std::chrono::nanoseconds{10});
 
+    // Batches can also be sent by wall time (better for threads which mostly sleep), or by size.
+    // A batch is sent when any of these is reached.
+    //proc.set_callback_wall_period(std::chrono::milliseconds{100});
+    //proc.set_callback_records(4096);
+    //proc.set_callback_bytes(1 << 20);
+
     // Enable the timer. While disabled, the tiemr overhead is very small.
     // Note that this only effects scope timers that *haven't* started yet.
     proc.set_enabled(true);
@@ -57,6 +63,10 @@ void foo() {
     SCOPE_TIMER(.set_name("foo"));
 
     // You can attach arbitrary information to a frame using `info` of type `TypeEraser`,
+    // Small trivially-copyable values (up to CHARMONIUM_SCOPE_TIMER_INFO_CAPACITY bytes) are stored in the frame without allocating.
+    SCOPE_TIMER(.set_info(ch_sc::make_type_eraser<uint64_t>(uint64_t{42})));
+
+    // Others are allocated and owned by the frame.
     auto info = std::vector<std::string>{"hello", "world"};
     auto type_erased_info = ch_sc::make_type_eraser<std::vector<std::string>>(info);
 
@@ -79,7 +89,7 @@ void Callback::thread_start(ch_sc::Thread& thread) {
 void Callback::thread_in_situ(ch_sc::Thread& thread) {
     // `process.callback_once()` says to never call in_situ.
     // `process.callback_every()` says to call in_situ every time a timer finishes.
-    // `process.set_callback_period(std::chrono::nanoseconds{1000})` says to call in_situ in batches of 1000ns.
+    // `process.set_callback_period(std::chrono::nanoseconds{1000})` says to call in_situ in batches of 1000ns of CPU time.
 
     // If you call `thread.drain_finished()`, you get the finished timers, and they are removed from the `Thread`.
     // If you don't, finished timers remain in the `Thread`, and you can access them the _next_ time you call `thread.drain_finished()`.
@@ -106,7 +116,10 @@ void Callback::thread_in_situ(ch_sc::Thread& thread) {
     }
 }
 void Callback::thread_stop(ch_sc::Thread& thread) {
-    for ([[maybe_unused]] const auto& timer : thread.drain_finished()) {
-        // Similar to `Callback::thread_in_situ`, but called (unconditionally) when threads stop.
-    }
+    // Similar to `Callback::thread_in_situ`, but called (unconditionally) when threads stop.
+    // `thread.visit_finished` is like `thread.drain_finished`, but it hands you the timers in place, without copying them.
+    thread.visit_finished([](const ch_sc::Timer* begin, const ch_sc::Timer* end) {
+        for ([[maybe_unused]] const ch_sc::Timer* timer = begin; timer != end; ++timer) {
+        }
+    });
 }
@@ -54,15 +54,6 @@ static void fn_thready_timing() {
 	exec_in_thread(fn_timing);
 }
 
-static int64_t rdtsc() {
-	uint32_t lo = 0;
-	uint32_t hi = 0;
-	// NOLINTNEXTLINE(hicpp-no-assembler)
-	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
-	// NOLINTNEXTLINE(hicpp-signed-bitwise)
-	return static_cast<int64_t>(hi) << std::numeric_limits<uint32_t>::digits | lo;
-}
-
 /*
  * When testing the timers, I will still call noop().
  * The deviation of noop() is relatively low, so it does not impact perfomance that much.
@@ -84,14 +75,30 @@ static void check_cpu() {
 	(void)(cpu);
 }
 
+static void check_cpu_clock() {
+	noop();
+	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
+	auto cpu  = ch_sc::get_thread().get_cpu_clock().now();
+	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
+	(void)(cpu);
+}
+
 static void check_tsc() {
 	noop();
 	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
-	auto tsc  = rdtsc();
+	auto tsc  = ch_sc::detail::rdtsc();
 	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
 	(void)(tsc);
 }
 
+static void check_wall_clock() {
+	noop();
+	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
+	auto stamp  = ch_sc::get_process().get_wall_clock().stamp_start();
+	if (ch_sc::detail::use_fences) { ch_sc::detail::fence(); }
+	(void)(stamp);
+}
+
 int main() {
 	constexpr int64_t TRIALS = 1024 * 32;
 
@@ -159,12 +166,26 @@ int main() {
 		}
 	});
 
+	bool cpu_clock_userspace = false;
+	int64_t time_check_cpu_clock = exec_in_thread([&] {
+		cpu_clock_userspace = ch_sc::get_thread().get_cpu_clock().is_userspace();
+		for (size_t i = 0; i < TRIALS; ++i) {
+			check_cpu_clock();
+		}
+	});
+
 	int64_t time_check_tsc = exec_in_thread([&] {
 		for (size_t i = 0; i < TRIALS; ++i) {
 			check_tsc();
 		}
 	});
 
+	int64_t time_check_wall_clock = exec_in_thread([&] {
+		for (size_t i = 0; i < TRIALS; ++i) {
+			check_wall_clock();
+		}
+	});
+
 	int64_t time_unbatched_cbs = time_unbatched - time_logging;
 
 	std::cout
@@ -173,8 +194,12 @@ int main() {
 		<< "Overhead when runtime-disabled = " << (time_rt_disabled - time_none) / TRIALS << "ns per call" << std::endl
 		<< "Overhead check wall = " << (time_check_wall - time_none) / TRIALS << "ns per call" << std::endl
 		<< "Overhead check cpu = " << (time_check_cpu - time_none) / TRIALS << "ns per call" << std::endl
+		<< "Overhead check CpuClock (" << (cpu_clock_userspace ? "perf_event" : "syscall") << ") = " << (time_check_cpu_clock - time_none) / TRIALS << "ns per call" << std::endl
 		<< "Overhead check tsc = " << (time_check_tsc - time_none) / TRIALS << "ns per call" << std::endl
+		<< "Overhead check WallClock (" << (process.get_wall_clock().get_source() == ch_sc::WallClockSource::tsc ? "tsc" : "monotonic") << ") = " << (time_check_wall_clock - time_none) / TRIALS << "ns per call" << std::endl
 		<< "Overhead of timing and storing frame = " << (time_logging - time_none) / TRIALS << "ns per call" << std::endl
+		<< "Calibrated overhead (wall) = " << ch_sc::detail::get_ns(process.get_overhead().wall_inside) << "ns inside + " << ch_sc::detail::get_ns(process.get_overhead().wall_outside) << "ns outside the frame" << std::endl
+		<< "Calibrated overhead (cpu) = " << ch_sc::detail::get_ns(process.get_overhead().cpu_inside) << "ns inside + " << ch_sc::detail::get_ns(process.get_overhead().cpu_outside) << "ns outside the frame" << std::endl
 		/*
 		  I assume a linear model:
 		  - time_unbatched_cbs = TRIALS * per_callback_overhead + TRIALS * per_frame_overhead
@@ -11,7 +11,15 @@ bazel run //example:scope_timer_example \
 	  --linkopt='-pthread' \
 ;
 
-bazel test //test:scope_timer_test \
+bazel test \
+	  //test:scope_timer_test \
+	  //test:scope_timer_counters_test \
+	  //test:scope_timer_sched_events_test \
+	  //test:scope_timer_gaps_test \
+	  //test:scope_timer_live_stack_test \
+	  //test:scope_timer_wall_clock_only_test \
+	  //test:scope_timer_cpu_clock_only_test \
+	  //test:scope_timer_no_clocks_test \
 	  --cxxopt='-std=c++11' \
 	  --copt='-Wall' \
 	  --copt='-Wextra' \
@@ -20,7 +28,7 @@ bazel test //test:scope_timer_test \
 	  --copt='-fsanitize=address' \
 	  --linkopt='-fsanitize=address' \
 	  --strip=never \
-|| (cat bazel-out/k8-fastbuild/testlogs/test/scope_timer_test/test.log ; exit 1)
+|| (cat bazel-out/k8-fastbuild/testlogs/test/scope_timer*_test/test.log ; exit 1)
 	  # --copt='-fsanitize=thread' \
 	  # --linkopt='-fsanitize=thread' \
 
@@ -5,6 +5,7 @@
 #include <list>
 #include <mutex>
 #include <ostream>
+#include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -232,3 +233,1128 @@ TEST(CpuTimerTest, TraceCorrectness) {
 		proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
 	}
 }
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, WallClockConversion) {
+	for (ch_sc::WallClockSource source : {ch_sc::WallClockSource::monotonic, ch_sc::WallClockSource::tsc}) {
+		ch_sc::WallClock clock {source};
+		std::this_thread::sleep_for(std::chrono::milliseconds{20});
+		ch_sc::WallNs expected_before = ch_sc::wall_now() - clock.get_start();
+		ch_sc::detail::WallStamp stamp = clock.stamp_start();
+		ch_sc::WallNs expected_after = ch_sc::wall_now() - clock.get_start();
+		ch_sc::WallNs actual = clock.since_start(stamp);
+		// Calibration error should be much less than 1%.
+		ch_sc::WallNs tolerance = expected_after / 100;
+		EXPECT_GE(actual, expected_before - tolerance) << "WallClock should agree with CLOCK_MONOTONIC";
+		EXPECT_LE(actual, expected_after + tolerance) << "WallClock should agree with CLOCK_MONOTONIC";
+		ch_sc::detail::WallStamp start = clock.stamp_start();
+		ch_sc::detail::WallStamp stop = clock.stamp_stop();
+		EXPECT_LT(clock.since_start(start), clock.since_start(stop)) << "WallClock should be monotonic";
+	}
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, CpuClockAgreesWithSyscall) {
+	ch_sc::CpuClock clock;
+	ch_sc::CpuNs before = ch_sc::cpu_now();
+	ch_sc::CpuNs first = clock.now();
+	ch_sc::detail::fence();
+	for (volatile size_t i = 0; i < 1000 * 1000; i = i + 1) { }
+	ch_sc::CpuNs second = clock.now();
+	ch_sc::CpuNs after = ch_sc::cpu_now();
+	EXPECT_LT(first, second) << "CpuClock should advance while this thread runs";
+	// Allow a little slack for the perf page's extrapolation.
+	ch_sc::CpuNs slack {100 * 1000};
+	EXPECT_GE(first, before - slack) << "CpuClock should agree with CLOCK_THREAD_CPUTIME_ID";
+	EXPECT_LE(second, after + slack) << "CpuClock should agree with CLOCK_THREAD_CPUTIME_ID";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, ClockPolicyRemovesStamps) {
+	EXPECT_TRUE(std::is_empty<ch_sc::detail::WallStamps<false>>::value) << "Disabled clocks should take no space in Timer";
+	EXPECT_TRUE(std::is_empty<ch_sc::detail::CpuStamps<false>>::value) << "Disabled clocks should take no space in Timer";
+	EXPECT_FALSE(std::is_empty<ch_sc::detail::WallStamps<true>>::value);
+	EXPECT_FALSE(std::is_empty<ch_sc::detail::CpuStamps<true>>::value);
+	EXPECT_TRUE((std::is_empty<ch_sc::detail::GapStamps<false, ch_sc::detail::WallClock>>::value)) << "Gaps should take no space in Timer unless enabled";
+}
+
+class GapStamps : public ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock> {
+public:
+	using ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock>::add_child_gap;
+	using ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock>::finish_gaps;
+	using ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock>::get_max_gap_stamps;
+	using ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock>::get_max_gap_next_index;
+	using ch_sc::detail::GapStamps<true, ch_sc::detail::WallClock>::get_max_gap_next_callsite;
+};
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, MissingTimeGaps) {
+	// A frame from 100 to 200, with children at [110, 120], [150, 160], and [165, 190].
+	GapStamps gaps;
+	gaps.add_child_gap(100, 110, 120, 1, 7);
+	EXPECT_EQ(10, gaps.get_max_gap_stamps());
+	EXPECT_EQ(1, gaps.get_max_gap_next_index()) << "The gap before the eldest child starts at the frame's start";
+	gaps.add_child_gap(100, 150, 160, 2, 8);
+	gaps.add_child_gap(100, 165, 190, 3, 9);
+	gaps.finish_gaps(100, 200);
+	EXPECT_EQ(30, gaps.get_max_gap_stamps()) << "The largest gap is between the first and second children";
+	EXPECT_EQ(2, gaps.get_max_gap_next_index());
+	EXPECT_EQ(8, gaps.get_max_gap_next_callsite());
+
+	GapStamps leaf;
+	leaf.finish_gaps(100, 200);
+	EXPECT_EQ(100, leaf.get_max_gap_stamps()) << "A leaf is one gap";
+	EXPECT_EQ(0, leaf.get_max_gap_next_index()) << "A gap which runs to the frame's stop has no next child";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, SchedEventsCountFaults) {
+	ch_sc::SchedEvents sched_events;
+	ch_sc::SchedCounts before;
+	sched_events.read(before);
+	constexpr size_t PAGES = 64;
+	constexpr size_t PAGE_SIZE = 4096;
+	std::unique_ptr<volatile char[]> memory {new volatile char[PAGES * PAGE_SIZE]};
+	for (size_t page = 0; page < PAGES; ++page) {
+		memory[page * PAGE_SIZE] = 1;
+	}
+	ch_sc::SchedCounts after;
+	sched_events.read(after);
+	EXPECT_GT((after - before).minor_faults, 0) << "Touching fresh pages should fault";
+	EXPECT_LT(sched_events.get_cpu_id(), static_cast<uint32_t>(sysconf(_SC_NPROCESSORS_CONF))) << "CPU id should be a CPU number";
+	std::this_thread::sleep_for(std::chrono::milliseconds{1});
+	ch_sc::SchedCounts slept;
+	sched_events.read(slept);
+	EXPECT_GT((slept - after).voluntary_switches, 0) << "Sleeping should block";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, SchedEventsInTimer) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_enabled(true);
+	std::thread th {[] {
+		SCOPE_TIMER(.set_name("sleeper"));
+		std::this_thread::sleep_for(std::chrono::milliseconds{1});
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	auto frames = proc.get_callback<StoreCallback>().get_all_frames(id);
+	ASSERT_EQ(2, frames.size());
+	// Built with -DCHARMONIUM_SCOPE_TIMER_SCHED_EVENTS=1 (see test/BUILD.bazel).
+	if (ch_sc::detail::use_sched_events) {
+		EXPECT_GT(frames.front().get_sched_counts().voluntary_switches, 0) << "A sleeping frame should count its blocking";
+	} else {
+		EXPECT_EQ(0, frames.front().get_sched_counts().voluntary_switches);
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+static void spin(ch_sc::CpuNs duration) {
+	ch_sc::CpuNs stop = ch_sc::cpu_now() + duration;
+	while (ch_sc::cpu_now() < stop) { }
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, HardwareCountersCount) {
+	// Built with -DCHARMONIUM_SCOPE_TIMER_MAX_COUNTERS (see test/BUILD.bazel).
+	if (ch_sc::detail::max_counters == 0) {
+		return;
+	}
+	ch_sc::HardwareCounters counters {std::vector<ch_sc::HardwareCounter>{ch_sc::HardwareCounter::instructions}};
+	ASSERT_EQ(1, counters.size());
+	EXPECT_EQ(ch_sc::HardwareCounter::instructions, counters.get_kind(0));
+	ch_sc::HardwareCounters::Values before {};
+	ch_sc::HardwareCounters::Values after {};
+	counters.read(before);
+	spin(ch_sc::CpuNs{1000000});
+	counters.read(after);
+	if (counters.is_available(0)) {
+		EXPECT_GT(after[0] - before[0], 0) << "A busy loop should retire instructions";
+	} else {
+		// No PMU here (e.g. a VM or perf_event_paranoid); unavailable counters read 0.
+		EXPECT_FALSE(counters.is_userspace());
+		EXPECT_EQ(0, after[0]);
+	}
+
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	bool available = false;
+	std::thread th {[&available] {
+		available = ch_sc::get_thread().get_hardware_counters().is_available(0);
+		SCOPE_TIMER();
+		spin(ch_sc::CpuNs{1000000});
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	auto frames = proc.get_callback<StoreCallback>().get_all_frames(id);
+	ASSERT_EQ(2, frames.size());
+	if (available) {
+		EXPECT_GT(frames.front().get_counter(0), 0) << "Timers should record the counters' change";
+	} else {
+		EXPECT_EQ(0, frames.front().get_counter(0));
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, OverheadCorrection) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_enabled(true);
+	std::thread th {trace1};
+	th.join();
+	auto& sc = proc.get_callback<StoreCallback>();
+	ch_sc::Overhead overhead = proc.get_overhead();
+	if (ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GT(overhead.wall_inside + overhead.wall_outside, ch_sc::WallNs{0}) << "Timing a frame can't be free";
+	} else {
+		EXPECT_EQ(overhead.wall_inside + overhead.wall_outside, ch_sc::WallNs{0}) << "Unread clocks have no overhead";
+	}
+	if (ch_sc::detail::ClockPolicy::cpu) {
+		EXPECT_GT(overhead.cpu_inside + overhead.cpu_outside, ch_sc::CpuNs{0}) << "Timing a frame can't be free";
+	} else {
+		EXPECT_EQ(overhead.cpu_inside + overhead.cpu_outside, ch_sc::CpuNs{0}) << "Unread clocks have no overhead";
+	}
+	for (const std::thread::id id : sc.threads()) {
+		auto frames = sc.get_all_frames(id);
+		std::sort(frames.begin(), frames.end(), [](const ch_sc::Timer& f1, const ch_sc::Timer& f2) {
+			return f1.get_index() < f2.get_index();
+		});
+		EXPECT_EQ(frames.size() - 1, frames.at(0).get_num_descendants()) << "Every frame descends from thread_main";
+		for (const auto& frame : frames) {
+			size_t num_children = 0;
+			size_t num_descendants = 0;
+			ch_sc::WallNs children_corrected {0};
+			bool child_saturated = false;
+			if (!frame.is_leaf()) {
+				size_t child_index = frame.get_youngest_callee_index();
+				const ch_sc::Timer* child = nullptr;
+				do {
+					child = &frames.at(child_index);
+					++num_children;
+					num_descendants += 1 + child->get_num_descendants();
+					children_corrected += child->get_corrected_wall(overhead);
+					// Corrections are clamped at zero, which breaks the additivity checked below.
+					child_saturated = child_saturated || child->get_corrected_wall(overhead) == ch_sc::WallNs{0};
+					child_index = child->get_prev_index();
+				} while (child->has_prev());
+			}
+			EXPECT_EQ(num_children, frame.get_num_children());
+			EXPECT_EQ(num_descendants, frame.get_num_descendants());
+			// Allow for rounding when converting stamps to ns.
+			ch_sc::WallNs rounding {1 + static_cast<int64_t>(num_children)};
+			EXPECT_LE(frame.get_corrected_wall(overhead), frame.get_stop_wall() - frame.get_start_wall() + rounding) << "Correction should only remove time";
+			EXPECT_LE(frame.get_corrected_cpu(overhead), frame.get_stop_cpu() - frame.get_start_cpu()) << "Correction should only remove time";
+			if (!child_saturated && frame.get_corrected_wall(overhead) > children_corrected + rounding) {
+				EXPECT_LE(frame.get_corrected_exclusive_wall(overhead), frame.get_corrected_wall(overhead) + rounding) << "Exclusive time is part of inclusive time";
+				ch_sc::WallNs error = frame.get_corrected_wall(overhead) - children_corrected - frame.get_corrected_exclusive_wall(overhead);
+				EXPECT_LE(error, rounding) << "Corrected exclusive time should be inclusive time less children's inclusive time";
+				EXPECT_GE(error, -rounding) << "Corrected exclusive time should be inclusive time less children's inclusive time";
+			}
+		}
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, ExclusiveTime) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_enabled(true);
+	std::thread th {trace1};
+	th.join();
+	auto& sc = proc.get_callback<StoreCallback>();
+	for (const std::thread::id id : sc.threads()) {
+		auto frames = sc.get_all_frames(id);
+		std::sort(frames.begin(), frames.end(), [](const ch_sc::Timer& f1, const ch_sc::Timer& f2) {
+			return f1.get_index() < f2.get_index();
+		});
+		for (const auto& frame : frames) {
+			ch_sc::CpuNs children_cpu {0};
+			ch_sc::WallNs children_wall {0};
+			if (!frame.is_leaf()) {
+				size_t child_index = frame.get_youngest_callee_index();
+				const ch_sc::Timer* child = nullptr;
+				do {
+					child = &frames.at(child_index);
+					children_cpu += child->get_stop_cpu() - child->get_start_cpu();
+					children_wall += child->get_stop_wall() - child->get_start_wall();
+					child_index = child->get_prev_index();
+				} while (child->has_prev());
+			}
+			EXPECT_EQ(frame.get_stop_cpu() - frame.get_start_cpu() - children_cpu, frame.get_exclusive_cpu()) << "Exclusive time should be inclusive time less children's inclusive time";
+			// Allow for rounding when converting stamps to ns.
+			ch_sc::WallNs error = frame.get_stop_wall() - frame.get_start_wall() - children_wall - frame.get_exclusive_wall();
+			ch_sc::WallNs rounding {2 + static_cast<int64_t>(frame.get_num_children())};
+			EXPECT_LE(error, rounding) << "Exclusive time should be inclusive time less children's inclusive time";
+			EXPECT_GE(error, -rounding) << "Exclusive time should be inclusive time less children's inclusive time";
+			EXPECT_LE(frame.get_max_gap_wall(), frame.get_exclusive_wall() + rounding) << "A gap is part of the exclusive time";
+			EXPECT_LE(frame.get_max_gap_cpu(), frame.get_exclusive_cpu()) << "A gap is part of the exclusive time";
+		}
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, CompactRecord) {
+	for (uint64_t duration : {uint64_t{0}, uint64_t{12345}, (uint64_t{1} << 31U) - 1, uint64_t{1} << 31U, uint64_t{987654321987}, uint64_t{1} << 56U}) {
+		uint64_t decoded = ch_sc::detail::decode_duration(ch_sc::detail::encode_duration(duration));
+		EXPECT_LE(decoded, duration) << "Encoded durations should round down";
+		EXPECT_LE(duration - decoded, duration >> 25U) << "Encoded durations should keep 25 significant bits";
+	}
+
+	auto& callsites = ch_sc::get_process().get_callsites();
+	ch_sc::CallSiteCache cache;
+	auto source_loc = CHARMONIUM_SCOPE_TIMER_SOURCE_LOC();
+	ch_sc::CallSiteId id = cache.get_id(callsites, "compact", source_loc);
+	EXPECT_EQ(id, cache.get_id(callsites, "compact", source_loc)) << "A CallSite should be interned once";
+	EXPECT_EQ(id, callsites.intern("compact", source_loc).id) << "A CallSite should be interned once";
+	EXPECT_NE(id, cache.get_id(callsites, "other", source_loc)) << "A different name is a different CallSite";
+	EXPECT_STREQ("compact", callsites.get(id).name);
+	EXPECT_EQ(0, callsites.intern("", ch_sc::detail::SourceLoc{}).id) << "Id 0 is the root frame's CallSite";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, InlineTypeEraser) {
+	EXPECT_FALSE(ch_sc::TypeEraser{}) << "Default TypeEraser should be empty";
+
+	ch_sc::TypeEraser small = ch_sc::make_type_eraser<uint64_t>(uint64_t{42});
+	ch_sc::TypeEraser small_copy = small;
+	EXPECT_EQ(42, ch_sc::extract_type_eraser<uint64_t>(small_copy));
+	// Inline values live in the TypeEraser itself.
+	EXPECT_EQ(static_cast<const void*>(&small), static_cast<const void*>(&ch_sc::extract_type_eraser<uint64_t>(small)));
+
+	ch_sc::TypeEraser big = ch_sc::make_type_eraser<std::string>("a string too long for the inline buffer");
+	ch_sc::TypeEraser big_copy = big;
+	ch_sc::extract_type_eraser<std::string>(big) += "!";
+	EXPECT_EQ("a string too long for the inline buffer", ch_sc::extract_type_eraser<std::string>(big_copy)) << "Copies should not share spilled values";
+	ch_sc::TypeEraser big_moved = std::move(big);
+	EXPECT_EQ("a string too long for the inline buffer!", ch_sc::extract_type_eraser<std::string>(big_moved));
+
+	ch_sc::TypeEraser adopted = ch_sc::make_type_eraser<int>(new int{7});
+	EXPECT_EQ(7, ch_sc::extract_type_eraser<int>(adopted));
+
+	using Unique = std::unique_ptr<int>;
+	ch_sc::TypeEraser unique = ch_sc::make_type_eraser<Unique>(Unique{new int{9}});
+	ch_sc::TypeEraser unique_copy = unique;
+	EXPECT_TRUE(unique_copy.holds<Unique>());
+	EXPECT_EQ(&ch_sc::extract_type_eraser<Unique>(unique), &ch_sc::extract_type_eraser<Unique>(unique_copy)) << "Copies should share values which cannot be copied";
+	unique = ch_sc::TypeEraser{};
+	EXPECT_EQ(9, *ch_sc::extract_type_eraser<Unique>(unique_copy)) << "The shared value should outlive the first copy";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, TimersRecycleChunks) {
+	using Pool = ch_sc::detail::TimerChunkPool;
+	auto pool = std::make_shared<Pool>();
+	size_t chunks = 3;
+	{
+		ch_sc::Timers timers {pool};
+		for (size_t i = 0; i < chunks * Pool::chunk_size; ++i) {
+			timers.emplace_back(0, static_cast<ch_sc::detail::IndexNo>(i), 0, 0, ch_sc::TypeEraser{});
+		}
+		const ch_sc::Timer* first = &timers.front();
+		timers.emplace_back(0, 0, 0, 0, ch_sc::TypeEraser{});
+		EXPECT_EQ(first, &timers.front()) << "Appending should not move Timers";
+		EXPECT_EQ(chunks * Pool::chunk_size + 1, timers.size());
+		EXPECT_EQ(0, pool->get_num_free());
+	}
+	EXPECT_EQ(chunks + 1, pool->get_num_free()) << "Destroyed Timers should return their chunks to the pool";
+	ch_sc::Timers timers {pool};
+	timers.emplace_back(0, 0, 0, 0, ch_sc::TypeEraser{});
+	EXPECT_EQ(chunks, pool->get_num_free()) << "New Timers should reuse pooled chunks";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, VisitFinishedInPlace) {
+	using Pool = ch_sc::detail::TimerChunkPool;
+	auto pool = std::make_shared<Pool>();
+	ch_sc::detail::FinishedQueue finished {pool};
+	size_t frames = 2 * Pool::chunk_size + 10;
+	for (size_t i = 0; i < frames; ++i) {
+		finished.push(ch_sc::Timer{0, static_cast<ch_sc::detail::IndexNo>(i), 0, 0, ch_sc::TypeEraser{}});
+	}
+	size_t spans = 0;
+	size_t count = 0;
+	EXPECT_EQ(frames, finished.visit([&](const ch_sc::Timer* begin, const ch_sc::Timer* end) {
+		++spans;
+		for (const ch_sc::Timer* frame = begin; frame != end; ++frame) {
+			EXPECT_EQ(count, frame->get_index()) << "Spans should be contiguous and in order";
+			++count;
+		}
+	}));
+	EXPECT_EQ(3, spans) << "There should be one span per chunk";
+	EXPECT_EQ(frames, count);
+	EXPECT_EQ(0, finished.size());
+	EXPECT_EQ(2, pool->get_num_free()) << "Visited chunks should return to the pool";
+
+	finished.push(ch_sc::Timer{0, 0, 0, 0, ch_sc::TypeEraser{}});
+	EXPECT_EQ(1, finished.visit([](const ch_sc::Timer*, const ch_sc::Timer*) { }));
+	EXPECT_EQ(0, finished.visit([](const ch_sc::Timer*, const ch_sc::Timer*) { }));
+	EXPECT_EQ(2, pool->get_num_free()) << "Visiting should not allocate chunks";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, BoundedBuffer) {
+	constexpr size_t CAPACITY = 8;
+	constexpr size_t FRAMES = 20;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_buffer_capacity(CAPACITY);
+	for (ch_sc::OverflowPolicy policy : {ch_sc::OverflowPolicy::drop_newest, ch_sc::OverflowPolicy::overwrite_oldest, ch_sc::OverflowPolicy::flush}) {
+		proc.set_overflow_policy(policy);
+		proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+		size_t dropped = 0;
+		std::thread th {[&dropped] {
+			for (size_t i = 0; i < FRAMES; ++i) {
+				SCOPE_TIMER();
+			}
+			dropped = ch_sc::get_thread().get_num_dropped();
+		}};
+		th.join();
+		auto& sc = proc.get_callback<StoreCallback>();
+		for (const std::thread::id id : sc.threads()) {
+			auto frames = sc.get_all_frames(id);
+			EXPECT_EQ(0, frames.back().get_index()) << "The root frame is always kept";
+			if (policy == ch_sc::OverflowPolicy::flush) {
+				EXPECT_EQ(0, dropped);
+				EXPECT_EQ(FRAMES + 1, frames.size()) << "Flushing should keep every frame";
+				EXPECT_GT(sc.num_thread_in_situs(id), 0);
+			} else {
+				EXPECT_EQ(FRAMES - CAPACITY, dropped);
+				EXPECT_EQ(CAPACITY + 1, frames.size()) << "The buffer should hold its capacity plus the root frame";
+				size_t first_kept = policy == ch_sc::OverflowPolicy::drop_newest ? 1 : FRAMES - CAPACITY + 1;
+				EXPECT_EQ(first_kept, frames.front().get_index());
+			}
+		}
+	}
+	proc.set_buffer_capacity(0);
+	proc.set_overflow_policy(ch_sc::OverflowPolicy::drop_newest);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, ConcurrentDrain) {
+	constexpr size_t FRAMES = 2000;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	std::atomic<ch_sc::Thread*> producer {nullptr};
+	std::atomic<bool> produced {false};
+	std::atomic<bool> drained {false};
+	std::thread th {[&] {
+		producer.store(&ch_sc::get_thread());
+		for (size_t i = 0; i < FRAMES; ++i) {
+			SCOPE_TIMER();
+		}
+		produced.store(true);
+		while (!drained.load()) {
+			std::this_thread::yield();
+		}
+	}};
+	while (producer.load() == nullptr) {
+		std::this_thread::yield();
+	}
+	size_t count = 0;
+	ch_sc::detail::IndexNo last_index = 0;
+	bool done = false;
+	while (!done) {
+		done = produced.load();
+		for (const ch_sc::Timer& frame : producer.load()->drain_finished()) {
+			EXPECT_EQ(last_index + 1, frame.get_index()) << "Frames should be drained once each, in order";
+			last_index = frame.get_index();
+			++count;
+		}
+	}
+	drained.store(true);
+	th.join();
+	EXPECT_EQ(FRAMES, count);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, SampleLiveStacks) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	std::atomic<bool> started {false};
+	std::atomic<bool> stop {false};
+	std::thread th {[&] {
+		SCOPE_TIMER(.set_name("outer"));
+		{
+			SCOPE_TIMER(.set_name("inner"));
+			started.store(true);
+			while (!stop.load()) {
+				// Churn below the waiting frames, so samples race with pushes and pops.
+				SCOPE_TIMER(.set_name("leaf"));
+			}
+		}
+	}};
+	while (!started.load()) {
+		std::this_thread::yield();
+	}
+	for (size_t i = 0; i < 1000; ++i) {
+		for (const ch_sc::ThreadSample& sample : proc.sample_stacks()) {
+			if (sample.thread_id != th.get_id()) {
+				continue;
+			}
+			// Built with -DCHARMONIUM_SCOPE_TIMER_LIVE_STACK=1 (see test/BUILD.bazel).
+			if (!ch_sc::detail::use_live_stack) {
+				ASSERT_EQ(0, sample.depth) << "Timed frames should not be published";
+				continue;
+			}
+			ASSERT_GE(sample.depth, 3);
+			ASSERT_LE(sample.depth, 4);
+			ASSERT_EQ(sample.depth, sample.frames.size());
+			EXPECT_EQ(std::string{"outer"}, sample.frames[1].get_name());
+			EXPECT_EQ(std::string{"inner"}, sample.frames[2].get_name());
+			if (sample.depth == 4) {
+				EXPECT_EQ(std::string{"leaf"}, sample.frames[3].get_name()) << "A sample should never see a half-written frame";
+			}
+			EXPECT_LE(sample.frames[1].get_start_wall(), sample.frames[2].get_start_wall());
+			EXPECT_LE(sample.frames[2].get_start_wall(), sample.sampled_wall);
+		}
+	}
+	stop.store(true);
+	th.join();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, SamplingMode) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_sampling_period(std::chrono::milliseconds{1});
+	std::vector<ch_sc::SampleNode> nodes;
+	bool recorded_timers = true;
+	std::thread th {[&] {
+		{
+			SCOPE_TIMER(.set_name("outer"));
+			for (size_t i = 0; i < 20; ++i) {
+				SCOPE_TIMER(.set_name("hot"));
+				// CPU-time timers may only fire on scheduler ticks, so spin for several.
+				spin(std::chrono::milliseconds{10});
+			}
+		}
+		const ch_sc::SampleTree* tree = ch_sc::get_thread().get_sample_tree();
+		ASSERT_NE(nullptr, tree);
+		nodes = tree->read();
+		recorded_timers = !ch_sc::get_thread().get_stack().empty();
+	}};
+	th.join();
+	proc.set_sampling_period(ch_sc::CpuNs{0});
+	EXPECT_FALSE(recorded_timers) << "A sampling thread should not record Timers";
+
+	uint64_t total = 0;
+	uint64_t in_hot = 0;
+	for (const ch_sc::SampleNode& node : nodes) {
+		total += node.samples;
+		if (node.samples != 0 && std::string{"hot"} == ch_sc::get_process().get_callsites().get(node.callsite).name) {
+			EXPECT_EQ(std::string{"outer"}, ch_sc::get_process().get_callsites().get(nodes[node.parent].callsite).name);
+			in_hot += node.samples;
+		}
+	}
+	EXPECT_GT(total, 10);
+	EXPECT_GT(in_hot * 2, total) << "Most samples should land in the hot scope";
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, RateLimit) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_rate_limit(1000);
+	uint64_t calls = 0;
+	ch_sc::CallSiteRate rate;
+	std::thread th {[&] {
+		// Run for several windows, so the first (which records every call) is a small part.
+		ch_sc::CpuNs stop = ch_sc::cpu_now() + 5 * std::chrono::nanoseconds{ch_sc::detail::RateLimiter::window_ns};
+		while (ch_sc::cpu_now() < stop) {
+			SCOPE_TIMER(.set_name("hot"));
+			++calls;
+		}
+		for (const ch_sc::CallSiteRate& rate_ : ch_sc::get_thread().get_callsite_rates()) {
+			if (rate_.get_calls() != 0) {
+				rate = rate_;
+			}
+		}
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	proc.set_rate_limit(0);
+
+	EXPECT_EQ(calls, rate.get_calls()) << "Every call should be counted";
+	if (ch_sc::detail::ClockPolicy::cpu || ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GT(rate.get_sample_every(), 1);
+		EXPECT_LT(rate.get_recorded() * 2, calls) << "Most calls should be skipped";
+	} else {
+		EXPECT_EQ(calls, rate.get_recorded()) << "Without a clock to measure rates, every call should be recorded";
+	}
+	auto& sc = proc.get_callback<StoreCallback>();
+	auto frames = sc.get_all_frames(id);
+	EXPECT_EQ(rate.get_recorded() + 1, frames.size()) << "Only recorded calls (and the root) should be Timers";
+	for (const ch_sc::Timer& frame : frames) {
+		EXPECT_EQ(frames.back().get_index(), frame.get_caller_index()) << "Recorded frames should hang from recorded callers";
+	}
+	if (ch_sc::detail::ClockPolicy::cpu) {
+		EXPECT_GT(rate.get_estimated_cpu(), ch_sc::CpuNs{0});
+	}
+	if (ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GT(rate.get_estimated_wall(), ch_sc::WallNs{0});
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+static void coarse_and_fine() {
+	SCOPE_TIMER(.set_name("coarse"));
+	{
+		SCOPE_TIMER(.set_name("fine_a"));
+		SCOPE_TIMER(.set_name("fine_b"));
+	}
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, CallSiteEnabled) {
+	EXPECT_TRUE(ch_sc::detail::glob_match("fine_*", "fine_a"));
+	EXPECT_TRUE(ch_sc::detail::glob_match("*_?", "fine_b"));
+	EXPECT_FALSE(ch_sc::detail::glob_match("fine_*", "coarse"));
+
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	auto& callsites = proc.get_callsites();
+	// This rule precedes the CallSites' registration, so it must apply as they register.
+	callsites.set_enabled_by_name("fine_*", false);
+	for (bool fine : {false, true}) {
+		if (fine) {
+			callsites.set_enabled_by_file("*main.cpp", true);
+		}
+		proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+		std::thread th {coarse_and_fine};
+		std::thread::id id = th.get_id();
+		th.join();
+		auto frames = proc.get_callback<StoreCallback>().get_all_frames(id);
+		ASSERT_EQ(fine ? 4 : 2, frames.size());
+		EXPECT_EQ(std::string{"coarse"}, frames[frames.size() - 2].get_name());
+		if (fine) {
+			EXPECT_EQ(std::string{"fine_b"}, frames[0].get_name());
+			EXPECT_EQ(std::string{"fine_a"}, frames[1].get_name());
+			EXPECT_EQ(frames[1].get_index(), frames[0].get_caller_index());
+		}
+	}
+	callsites.reset_enabled();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+static void aggregated_work() {
+	SCOPE_TIMER(.set_name("a"));
+	for (size_t i = 0; i < 10; ++i) {
+		SCOPE_TIMER(.set_name("b"));
+	}
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, AggregateCallTree) {
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_aggregating(true);
+	proc.drain_call_tree();
+	std::thread th0 {aggregated_work};
+	std::thread th1 {aggregated_work};
+	std::thread::id id0 = th0.get_id();
+	th0.join();
+	th1.join();
+	proc.set_aggregating(false);
+	EXPECT_EQ(0, proc.get_callback<StoreCallback>().num_thread_stops(id0)) << "Aggregating threads should not keep frames";
+
+	ch_sc::CallTree tree = proc.drain_call_tree();
+	ASSERT_EQ(3, tree.size()) << "There should be one node per distinct path";
+	EXPECT_EQ(2, tree[0].get_count()) << "Each thread's root should finish into the root node";
+	const ch_sc::CallTreeNode& a = tree[1];
+	const ch_sc::CallTreeNode& b = tree[2];
+	EXPECT_EQ(std::string{"a"}, a.get_name());
+	EXPECT_EQ(std::string{"b"}, b.get_name());
+	EXPECT_EQ(1, b.get_parent());
+	EXPECT_EQ(2, a.get_count());
+	EXPECT_EQ(20, b.get_count());
+	EXPECT_LE(b.get_cpu_min(), b.get_cpu_max());
+	EXPECT_LE(b.get_cpu_max(), b.get_cpu());
+	EXPECT_EQ(b.get_cpu(), b.get_cpu_exclusive()) << "Leaves' exclusive time is their inclusive time";
+	EXPECT_LE(a.get_cpu_exclusive(), a.get_cpu() - b.get_cpu());
+	EXPECT_LE(a.get_wall_exclusive(), a.get_wall());
+
+	EXPECT_EQ(1, proc.drain_call_tree().size()) << "Draining should empty the trees";
+
+	// A live thread's tree is drained as of its last flush.
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_aggregating(true);
+	uint64_t unflushed = 1;
+	uint64_t flushed = 0;
+	std::thread th2 {[&] {
+		aggregated_work();
+		unflushed = proc.drain_call_tree().size();
+		proc.set_callback_period(ch_sc::CpuNs{1});
+		aggregated_work();
+		proc.callback_once();
+		ch_sc::CallTree live = proc.drain_call_tree();
+		flushed = live.size() > 1 ? live[1].get_count() : 0;
+	}};
+	th2.join();
+	proc.set_aggregating(false);
+	proc.drain_call_tree();
+	EXPECT_EQ(1, unflushed) << "Frames since the last flush should not be drained";
+	EXPECT_EQ(2, flushed) << "A flush should publish every finished frame";
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+static void gappy_work() {
+	SCOPE_TIMER(.set_name("gappy"));
+	{
+		SCOPE_TIMER(.set_name("gappy_first"));
+	}
+	// Uninstrumented, so the largest gap ends at the second child.
+	spin(std::chrono::milliseconds{2});
+	{
+		SCOPE_TIMER(.set_name("gappy_second"));
+	}
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, MissingTimeByCallSite) {
+	constexpr size_t CALLS = 3;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_aggregating(true);
+	proc.drain_call_tree();
+	std::thread th {[] {
+		for (size_t i = 0; i < CALLS; ++i) {
+			gappy_work();
+		}
+	}};
+	th.join();
+	proc.set_aggregating(false);
+
+	std::vector<ch_sc::CallTreeNode> totals = proc.drain_call_tree().get_callsite_totals();
+	const ch_sc::CallTreeNode* gappy = nullptr;
+	ch_sc::CallSiteId child = 0;
+	for (const ch_sc::CallTreeNode& node : totals) {
+		if (node.get_count() != 0 && std::string{"gappy"} == node.get_name()) {
+			gappy = &node;
+		}
+		if (node.get_count() != 0 && std::string{"gappy_second"} == node.get_name()) {
+			child = node.get_callsite_id();
+		}
+	}
+	ASSERT_NE(nullptr, gappy);
+	EXPECT_EQ(CALLS, gappy->get_count());
+	ASSERT_NE(0, child);
+	EXPECT_EQ(CALLS, totals[child].get_count());
+	if (ch_sc::detail::use_gaps && ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GE(gappy->get_max_gap_wall(), std::chrono::milliseconds{2});
+		EXPECT_EQ(child, gappy->get_max_gap_next_callsite()) << "The gap should end at the second child";
+		EXPECT_GE(gappy->get_max_gap_wall_sum(), CALLS * std::chrono::milliseconds{2});
+		EXPECT_LE(gappy->get_max_gap_wall_sum(), gappy->get_wall_exclusive()) << "Gaps are part of the exclusive time";
+	} else {
+		EXPECT_EQ(ch_sc::WallNs{0}, gappy->get_max_gap_wall_sum());
+	}
+	if (ch_sc::detail::use_gaps && ch_sc::detail::ClockPolicy::cpu) {
+		EXPECT_GE(gappy->get_max_gap_cpu(), std::chrono::milliseconds{2});
+		EXPECT_EQ(child, gappy->get_max_gap_cpu_next_callsite()) << "The gap should end at the second child";
+		EXPECT_GE(gappy->get_max_gap_cpu_sum(), CALLS * std::chrono::milliseconds{2});
+		EXPECT_LE(gappy->get_max_gap_cpu_sum(), gappy->get_cpu_exclusive()) << "Gaps are part of the exclusive time";
+	} else {
+		EXPECT_EQ(ch_sc::CpuNs{0}, gappy->get_max_gap_cpu_sum());
+	}
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, LatencyHistograms) {
+	ch_sc::Histogram histogram;
+	for (uint64_t value = 1; value <= 1000; ++value) {
+		histogram.record(value * 1000);
+	}
+	EXPECT_EQ(1000, histogram.get_count());
+	EXPECT_NEAR(500000, histogram.get_quantile(0.5), 500000 / 16);
+	EXPECT_NEAR(990000, histogram.get_quantile(0.99), 990000 / 16);
+	EXPECT_NEAR(1000000, histogram.get_quantile(1), 1000000 / 16);
+	for (size_t bucket = 1; bucket < ch_sc::Histogram::num_buckets; ++bucket) {
+		ASSERT_EQ(ch_sc::Histogram::bucket_upper(bucket - 1), ch_sc::Histogram::bucket_lower(bucket)) << "Buckets should tile the values";
+		ASSERT_EQ(bucket, ch_sc::Histogram::bucket_of(ch_sc::Histogram::bucket_lower(bucket)));
+	}
+
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_latency_histograms(true);
+	ch_sc::Latencies before = proc.read_latencies();
+	std::thread th0 {aggregated_work};
+	std::thread th1 {aggregated_work};
+	th0.join();
+	th1.join();
+	proc.set_latency_histograms(false);
+
+	ch_sc::Latencies window = proc.read_latencies();
+	window.subtract(before);
+	ch_sc::CallSiteId b_id = proc.get_callsites().get_size();
+	for (ch_sc::CallSiteId id = 0; id < proc.get_callsites().get_size(); ++id) {
+		if (std::string{"b"} == proc.get_callsites().get(id).name) {
+			b_id = id;
+		}
+	}
+	ASSERT_LT(b_id, proc.get_callsites().get_size());
+	const ch_sc::CallSiteLatency& b = window[b_id];
+	EXPECT_EQ(20, b.get_count()) << "Both exited threads' frames should be counted";
+	EXPECT_LE(b.get_cpu_quantile(0.5), b.get_cpu_quantile(0.99));
+	EXPECT_LE(b.get_wall_quantile(0.5), b.get_wall_quantile(0.99));
+	EXPECT_EQ(20, b.get_cpu_histogram().get_count());
+	EXPECT_EQ(b.get_cpu_total(), b.get_cpu_exclusive_total()) << "Leaves' exclusive time is their inclusive time";
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+static void keyed_work(uint64_t key, size_t times) {
+	for (size_t i = 0; i < times; ++i) {
+		SCOPE_TIMER(.set_name("keyed").set_info(ch_sc::make_type_eraser<uint64_t>(key)));
+		spin(ch_sc::CpuNs{static_cast<int64_t>(key * 1000)});
+	}
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, KeyedSketches) {
+	ch_sc::QuantileSketch sketch;
+	for (uint64_t value = 1; value <= 1000; ++value) {
+		sketch.add(value * 1000);
+	}
+	EXPECT_EQ(1000, sketch.get_count());
+	EXPECT_NEAR(500000, sketch.get_quantile(0.5), 500000 * ch_sc::QuantileSketch::relative_accuracy);
+	EXPECT_NEAR(990000, sketch.get_quantile(0.99), 990000 * ch_sc::QuantileSketch::relative_accuracy);
+	ch_sc::QuantileSketch merged;
+	merged.merge(sketch);
+	merged.merge(sketch);
+	EXPECT_EQ(2000, merged.get_count());
+	EXPECT_EQ(sketch.get_quantile(0.99), merged.get_quantile(0.99));
+
+	ch_sc::SketchTable table {4};
+	for (uint64_t key = 0; key < 100; ++key) {
+		table.add(1, key, ch_sc::CpuNs{1000}, 1000);
+		table.add(1, 0, ch_sc::CpuNs{1000}, 1000);
+	}
+	ASSERT_NE(nullptr, table.find(1, 0)) << "The most frequent key should not be evicted";
+	EXPECT_EQ(101, table.find(1, 0)->get_count());
+	ASSERT_NE(nullptr, table.find(1, ch_sc::SketchTable::other_key));
+	uint64_t total = 0;
+	for (const ch_sc::KeyedLatency& entry : table.get_entries()) {
+		total += entry.get_count();
+	}
+	EXPECT_EQ(200, total) << "Evicted keys should still be counted";
+
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	proc.set_sketch_key([](const ch_sc::Timer& frame) {
+		return frame.get_info().holds<uint64_t>() ? frame.get_info().get<uint64_t>() : 0;
+	});
+	proc.drain_sketches();
+	std::thread th0 {[] { keyed_work(10, 20); keyed_work(1000, 20); }};
+	std::thread th1 {[] { keyed_work(10, 20); }};
+	th0.join();
+	th1.join();
+	proc.set_sketch_key(nullptr);
+
+	ch_sc::SketchTable sketches = proc.drain_sketches();
+	const ch_sc::KeyedLatency* fast = nullptr;
+	const ch_sc::KeyedLatency* slow = nullptr;
+	for (const ch_sc::KeyedLatency& entry : sketches.get_entries()) {
+		if (std::string{"keyed"} == proc.get_callsites().get(entry.get_callsite_id()).name) {
+			(entry.get_key() == 10 ? fast : slow) = &entry;
+		}
+	}
+	ASSERT_NE(nullptr, fast);
+	ASSERT_NE(nullptr, slow);
+	EXPECT_EQ(1000, slow->get_key());
+	EXPECT_EQ(40, fast->get_count()) << "Both threads' frames should be merged";
+	EXPECT_EQ(20, slow->get_count());
+	if (ch_sc::detail::ClockPolicy::cpu) {
+		EXPECT_LT(fast->get_cpu_quantile(0.5), slow->get_cpu_quantile(0.5)) << "Keys should separate fast and slow inputs";
+	} else if (ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_LT(fast->get_wall_quantile(0.5), slow->get_wall_quantile(0.5)) << "Keys should separate fast and slow inputs";
+	}
+	EXPECT_TRUE(proc.drain_sketches().get_entries().empty()) << "Draining should clear the sketches";
+
+	// A live thread's sketches are drained as of its last flush.
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_sketch_key([](const ch_sc::Timer&) { return uint64_t{0}; });
+	size_t unflushed = 1;
+	size_t flushed = 0;
+	std::thread th2 {[&] {
+		keyed_work(10, 1);
+		unflushed = proc.drain_sketches().get_entries().size();
+		proc.set_callback_period(ch_sc::CpuNs{1});
+		keyed_work(10, 1);
+		proc.callback_once();
+		flushed = proc.drain_sketches().get_entries().size();
+	}};
+	th2.join();
+	proc.set_sketch_key(nullptr);
+	proc.drain_sketches();
+	EXPECT_EQ(0, unflushed) << "Frames since the last flush should not be drained";
+	EXPECT_NE(0, flushed) << "A flush should publish the sketches";
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+class StoreCollectorCallback : public ch_sc::CollectorCallbackType {
+public:
+	std::mutex mutex;
+	std::unordered_map<std::thread::id, size_t> frames;
+	void collect(std::vector<ch_sc::ThreadBatch>&& batches) override {
+		std::lock_guard<std::mutex> lock{mutex};
+		for (const auto& batch : batches) {
+			frames[batch.thread_id] += batch.frames.size();
+		}
+	}
+	size_t get_frames(std::thread::id id) {
+		std::lock_guard<std::mutex> lock{mutex};
+		return frames[id];
+	}
+};
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, CollectorDrainsThreads) {
+	constexpr size_t FRAMES = 10;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_collector_callback(std::unique_ptr<StoreCollectorCallback>{new StoreCollectorCallback});
+	auto& collector = proc.get_collector_callback<StoreCollectorCallback>();
+	proc.start_collector(std::chrono::milliseconds{1});
+	bool collected_while_idle = false;
+	std::thread th {[&] {
+		for (size_t i = 0; i < FRAMES; ++i) {
+			SCOPE_TIMER();
+		}
+		// This thread records nothing more, but the collector should still deliver its frames.
+		for (size_t attempt = 0; attempt < 1000 && !collected_while_idle; ++attempt) {
+			collected_while_idle = collector.get_frames(std::this_thread::get_id()) == FRAMES;
+			std::this_thread::sleep_for(std::chrono::milliseconds{1});
+		}
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	proc.stop_collector();
+	EXPECT_TRUE(collected_while_idle) << "The collector should drain idle threads";
+	EXPECT_EQ(FRAMES + 1, collector.get_frames(id)) << "The root frame should be delivered after the thread exits";
+	proc.set_collector_callback(std::unique_ptr<ch_sc::CollectorCallbackType>{new ch_sc::CollectorCallbackType});
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, BlockingBuffer) {
+	constexpr size_t CAPACITY = 8;
+	constexpr size_t FRAMES = 100;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_collector_callback(std::unique_ptr<StoreCollectorCallback>{new StoreCollectorCallback});
+	auto& collector = proc.get_collector_callback<StoreCollectorCallback>();
+	// OverflowPolicy::block needs a consumer; here it is the collector.
+	proc.start_collector(std::chrono::milliseconds{1});
+	proc.set_buffer_capacity(CAPACITY);
+	proc.set_overflow_policy(ch_sc::OverflowPolicy::block);
+	size_t dropped = 0;
+	std::thread th {[&dropped] {
+		for (size_t i = 0; i < FRAMES; ++i) {
+			SCOPE_TIMER();
+		}
+		dropped = ch_sc::get_thread().get_num_dropped();
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	proc.stop_collector();
+	proc.set_buffer_capacity(0);
+	proc.set_overflow_policy(ch_sc::OverflowPolicy::drop_newest);
+	EXPECT_EQ(0, dropped) << "A blocked thread should wait for the consumer, not drop frames";
+	EXPECT_EQ(FRAMES + 1, collector.get_frames(id));
+	proc.set_collector_callback(std::unique_ptr<ch_sc::CollectorCallbackType>{new ch_sc::CollectorCallbackType});
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, FlushTriggers) {
+	auto& proc = ch_sc::get_process();
+	proc.set_enabled(true);
+
+	constexpr size_t RECORDS = 5;
+	proc.callback_once();
+	proc.set_callback_records(RECORDS);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	std::thread th {[] {
+		for (size_t i = 0; i < 2 * RECORDS + 2; ++i) {
+			SCOPE_TIMER();
+		}
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	auto& sc = proc.get_callback<StoreCallback>();
+	EXPECT_EQ(2, sc.num_thread_in_situs(id)) << "Each batch should hold RECORDS frames";
+	EXPECT_EQ(3, sc.num_thread_stops(id)) << "The rest, and the root, should come at thread_stop";
+
+	constexpr size_t SLEEPS = 3;
+	proc.callback_once();
+	proc.set_callback_wall_period(std::chrono::milliseconds{1});
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	std::thread sleeper {[] {
+		for (size_t i = 0; i < SLEEPS; ++i) {
+			SCOPE_TIMER();
+			std::this_thread::sleep_for(std::chrono::milliseconds{2});
+		}
+	}};
+	id = sleeper.get_id();
+	sleeper.join();
+	auto& sleeper_sc = proc.get_callback<StoreCallback>();
+	if (ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GE(sleeper_sc.num_thread_in_situs(id), SLEEPS) << "A sleeping thread should flush on wall time";
+	} else {
+		EXPECT_EQ(0, sleeper_sc.num_thread_in_situs(id)) << "Without the wall clock, the wall period should never fire";
+	}
+
+	proc.callback_once();
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, ThreadChurn) {
+	constexpr size_t WAVES = 8;
+	constexpr size_t THREADS = 8;
+	constexpr size_t FRAMES = 10;
+	auto& proc = ch_sc::get_process();
+	proc.callback_once();
+	proc.set_enabled(true);
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ch_sc::CallbackType});
+	proc.set_latency_histograms(true);
+	ch_sc::Latencies before = proc.read_latencies();
+
+	// Readers walk the threads while they come and go, without blocking them.
+	std::atomic<bool> churning {true};
+	std::thread reader {[&] {
+		while (churning.load()) {
+			proc.sample_stacks();
+			proc.read_latencies();
+		}
+	}};
+	std::vector<std::thread::id> ids;
+	for (size_t wave = 0; wave < WAVES; ++wave) {
+		std::vector<std::thread> threads;
+		for (size_t thread = 0; thread < THREADS; ++thread) {
+			threads.emplace_back([] {
+				for (size_t i = 0; i < FRAMES; ++i) {
+					SCOPE_TIMER(.set_name("churn"));
+				}
+			});
+			ids.push_back(threads.back().get_id());
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+	churning.store(false);
+	reader.join();
+	proc.set_latency_histograms(false);
+
+	for (const ch_sc::ThreadSample& sample : proc.sample_stacks()) {
+		EXPECT_EQ(ids.end(), std::find(ids.begin(), ids.end(), sample.thread_id)) << "Exited threads should be deregistered";
+	}
+	ch_sc::Latencies window = proc.read_latencies();
+	window.subtract(before);
+	uint64_t churned = 0;
+	for (ch_sc::CallSiteId id = 0; id < proc.get_callsites().get_size(); ++id) {
+		if (std::string{"churn"} == proc.get_callsites().get(id).name) {
+			churned += window[id].get_count();
+		}
+	}
+	EXPECT_EQ(WAVES * THREADS * FRAMES, churned) << "Recorders reused by later threads should keep every frame";
+	proc.set_callback(std::unique_ptr<ch_sc::CallbackType>{new ErrCallback});
+}
+
+class ThrowOnceCallback : public ch_sc::CallbackType {
+public:
+	bool thrown {false};
+	void thread_start(ch_sc::Thread&) override {
+		if (!thrown) {
+			thrown = true;
+			throw std::runtime_error{"thread_start"};
+		}
+	}
+};
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, ThreadRegistryCleanup) {
+	std::unique_ptr<ch_sc::Process> proc {new ch_sc::Process};
+	proc->callback_once();
+	proc->set_callback(std::unique_ptr<ch_sc::CallbackType>{new ThrowOnceCallback});
+	proc->start_collector(std::chrono::milliseconds{1});
+	std::thread::id id = std::this_thread::get_id();
+	auto handle = static_cast<std::thread::native_handle_type>(ch_sc::detail::get_tid());
+
+	EXPECT_THROW(proc->create_thread(id, handle, std::string{"first"}), std::runtime_error);
+	EXPECT_TRUE(proc->sample_stacks().empty()) << "A Thread which failed to construct should not be registered";
+	proc->create_thread(id, handle, std::string{"second"});
+	ASSERT_EQ(1, proc->sample_stacks().size()) << "The thread should register after a failed attempt";
+
+	// Destroying the Process destroys the still-registered Thread, which hands off to the (stopped) collector.
+	proc.reset();
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, SharedProcess) {
+	ch_sc::Process& second_module_process();
+	EXPECT_EQ(&ch_sc::get_process(), &second_module_process()) << "Every translation unit should share one Process";
+	EXPECT_EQ(&ch_sc::get_process(), &*ch_sc::detail::get_process_anchor().process.lock()) << "The anchor should hold the shared Process";
+}
+
+// NOLINTNEXTLINE(hicpp-special-member-functions,cppcoreguidelines-special-member-functions,cppcoreguidelines-owning-memory,cert-err58-cpp,misc-unused-parameters)
+TEST(CpuTimerTest, PrivateProcess) {
+	std::unique_ptr<ch_sc::Process> proc {new ch_sc::Process};
+	proc->callback_once();
+	proc->set_enabled(true);
+	proc->set_callback(std::unique_ptr<ch_sc::CallbackType>{new StoreCallback});
+	std::thread th {[&proc] {
+		std::thread::id id = std::this_thread::get_id();
+		ch_sc::Thread& thread = proc->create_thread(id, static_cast<std::thread::native_handle_type>(ch_sc::detail::get_tid()), std::string{"private"});
+		{
+			// Not SCOPE_TIMER, which would also register this thread with the global Process.
+			ch_sc::ScopeTimer timer {ch_sc::ScopeTimerArgs{ch_sc::type_eraser_default, "private", false, proc.get(), &thread, CHARMONIUM_SCOPE_TIMER_SOURCE_LOC(), nullptr}};
+			std::this_thread::sleep_for(std::chrono::milliseconds{1});
+		}
+		proc->delete_thread(id);
+	}};
+	std::thread::id id = th.get_id();
+	th.join();
+	ch_sc::Timers frames = proc->get_callback<StoreCallback>().get_all_frames(id);
+	proc.reset();
+	ASSERT_EQ(2, frames.size());
+	EXPECT_STREQ("private", frames.front().get_name()) << "Frames of any Process should be named, even after it is gone";
+	if (ch_sc::detail::ClockPolicy::wall) {
+		EXPECT_GE(frames.front().get_exclusive_wall(), std::chrono::milliseconds{1}) << "Frames of any Process should convert with its clock";
+	}
+}
@@ -32,3 +32,5 @@ void trace2() {
 	// test diamond stack
 	trace4();
 }
+
+ch_sc::Process& second_module_process() { return ch_sc::get_process(); }